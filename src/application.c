@@ -4,14 +4,48 @@
 // ==================================================================
 #include "application.h"
 #include <assert.h>
+#include <string.h>
 
 
 // ==================================================================
 // initialize global variables
 // ==================================================================
 
-Vec4     g_TransformedVertices[30000];
-Triangle g_TrianglesToRender[10000];
+// the max number of instances of a mesh which are processed in a single pass over its faces
+#define INSTANCE_BATCH_SIZE 16
+
+// the state of an instance in a batch
+typedef struct
+{
+    Vec4 cameraPos;         // the camera in object space of the instance (see IsFaceFacingAway)
+    int  firstVertex;       // the idx of the first vertex of the instance in the transformed vertices
+    bool isInsideFrustum;   // none of the faces needs clipping (and there are no outcodes)
+} BatchInstance;
+
+// per-frame geometry buffers: they grow on demand and keep their capacity
+// across frames, so there are no reallocations in the steady state
+
+// clip space vertices of the current mesh (by their idxs) as SoA streams,
+// screen space vertices (valid only for vertices inside the clip volume)
+// and frustum outcodes of its clip space vertices
+static float*   s_VerticesStreams = NULL;     // 8 streams (clip + screen space) in one allocation
+static Outcode* s_VerticesOutcodes = NULL;
+static int      s_VerticesCapacity = 0;
+
+PointStreams g_TransformedVertices = { NULL, NULL, NULL, NULL };
+PointStreams g_ProjectedVertices   = { NULL, NULL, NULL, NULL };
+
+RenderQueue g_RenderQueue = { 0 };          // triangles to render this frame
+int*        g_TrianglesDrawOrder = NULL;    // idxs of the triangles to render sorted by depth
+
+// idxs of the instances to process in this frame grouped by their meshes:
+// the instances of the mesh i are [s_MeshFirstInstance[i], s_MeshFirstInstance[i + 1])
+static int* s_InstancesByMesh = NULL;       // dynamic arrs (see array.h)
+static int* s_MeshFirstInstance = NULL;
+
+// the max sizes the per-frame buffers have reached (high-water marks)
+static int s_MaxNumTransformedVertices = 0;
+static int s_MaxNumTrianglesToRender = 0;
 
 bool   g_IsRunning     = false;
 int    g_PrevFrameTime = 0;
@@ -24,15 +58,16 @@ int g_WndHalfWidth  = 400;
 int g_WndHalfHeight = 300;
 
 int g_NumTransformedVertices = 0;
-int g_NumTrianglesToRender = 0;
 
 
 // ==================================================================
 // Declaration of global transformation matrices
 // ==================================================================
-Matrix g_WorldMatrix;
 Matrix g_ViewMatrix;
 Matrix g_ProjMatrix;
+Matrix g_ViewProjMatrix;          // view * projection of the current frame
+Matrix g_WorldViewProjMatrix;     // world * view * projection of the current mesh
+Matrix g_ViewportMatrix;          // NDC => screen space
 
 
 // ==================================================================
@@ -58,21 +93,35 @@ void Initialize(void)
     // initialize render model and culling method
     SetRenderMethod(RENDER_TEXTURED);
     SetCullMethod(CULL_BACK);
+    SetRenderFlag(RENDER_FLAG_SIMD, true);
+    SetRenderFlag(RENDER_FLAG_GUARD_BAND, true);
+    SetRenderFlag(RENDER_FLAG_OCCLUSION_CULL, true);
 
     g_WndHalfWidth  = (wndWidth  >> 1);
     g_WndHalfHeight = (wndHeight >> 1);
 
+    // split the screen into tiles for binned rasterization
+    // and create worker threads to rasterize these tiles in parallel
+    InitTiles(wndWidth, wndHeight);
+    InitThreadPool(GetDefaultNumThreads());
+
     // initialize the scene direction light
     InitDirectedLight(Vec3Init(0, -1, 0));
 
 #if 1
-    LoadMesh(
+    // seen from above the ground hides everything below it so it's used
+    // as an occluder (from below it's culled as a back face, and then it
+    // hides nothing)
+    const int runwayIdx = LoadMesh(
         "assets/runway.obj",
         "assets/runway.png",
         Vec3Init(0, -1.5f, 23),
         Vec3Init(0, 0, 0),
         Vec3Init(1, 1, 1));
 
+    if (runwayIdx >= 0)
+        GetMeshInstanceByIdx(runwayIdx)->isOccluder = true;
+
     LoadMesh(
         "assets/f117.obj",
         "assets/f117.png",
@@ -118,16 +167,15 @@ void Initialize(void)
     g_RotationStep.y = 0.005f;
 
     // Initialize the perspective projection matrix
-    const float aspectX = (float)wndWidth / (float)wndHeight;                                                  
     const float aspectY = (float)wndHeight / (float)wndWidth;
     const float fovY    = M_PIDIV3;
-    const float fovX    = 2.0f * atan(tan(fovY/2) * aspectX);
     const float nearZ   = 1.0f;
     const float farZ    = 100.0f;
     g_ProjMatrix = MatrixInitPerspective(fovY, aspectY, nearZ, farZ);
 
-    // initialize frustum planes with a point and a normal vector
-    InitFrustumPlanes(fovX, fovY, nearZ, farZ);
+    // the viewport transformation works on clip space coords, so the
+    // perspective divide and mapping into screen space is a single multiply
+    MatrixViewport((float)g_WndHalfWidth, (float)g_WndHalfHeight, &g_ViewportMatrix);
 
     // setup mouse stuff
     SDL_ShowCursor(SDL_DISABLE);
@@ -156,6 +204,8 @@ void Shutdown(void)
     // call this func after finishing of the main game loop
     
     printf("Application shutdown:\n");
+    printf("- geometry buffers high-water marks: %d vertices, %d triangles to render\n",
+        s_MaxNumTransformedVertices, s_MaxNumTrianglesToRender);
 
     DestroyWindow();
     FreeResources();
@@ -213,6 +263,54 @@ void ProcessKeydown(const int keycode)
             SetRenderMethod(RENDER_TEXTURED_WIRE);
             break;
         }
+        case SDLK_F1:
+        {
+            // switch between the SIMD and scalar span kernels
+            SetRenderFlag(RENDER_FLAG_SIMD, !IsRenderFlag(RENDER_FLAG_SIMD));
+            break;
+        }
+        case SDLK_F2:
+        {
+            // switch perspective-correct texturing to subdivided spans and back
+            SetRenderFlag(RENDER_FLAG_SUBDIV_SPANS, !IsRenderFlag(RENDER_FLAG_SUBDIV_SPANS));
+            break;
+        }
+        case SDLK_F3:
+        {
+            // switch the length of subdivided spans between 8 and 16 pixels
+            SetSubdivSpanLength((GetSubdivSpanLength() == 8) ? 16 : 8);
+            break;
+        }
+        case SDLK_F4:
+        {
+            // switch the Hi-Z occlusion test on/off
+            SetRenderFlag(RENDER_FLAG_HIZ, !IsRenderFlag(RENDER_FLAG_HIZ));
+            break;
+        }
+        case SDLK_F5:
+        {
+            // switch between the z-buffer and the painter's algorithm
+            SetRenderFlag(RENDER_FLAG_PAINTER, !IsRenderFlag(RENDER_FLAG_PAINTER));
+            break;
+        }
+        case SDLK_F6:
+        {
+            // switch between the forward and the visibility buffer rendering
+            SetRenderFlag(RENDER_FLAG_VISBUFFER, !IsRenderFlag(RENDER_FLAG_VISBUFFER));
+            break;
+        }
+        case SDLK_F7:
+        {
+            // switch the guard-band clipping on/off
+            SetRenderFlag(RENDER_FLAG_GUARD_BAND, !IsRenderFlag(RENDER_FLAG_GUARD_BAND));
+            break;
+        }
+        case SDLK_F8:
+        {
+            // switch the occlusion culling of instances on/off
+            SetRenderFlag(RENDER_FLAG_OCCLUSION_CULL, !IsRenderFlag(RENDER_FLAG_OCCLUSION_CULL));
+            break;
+        }
         case SDLK_F12:
         {
             SDL_DisplayMode displayMode;
@@ -352,10 +450,10 @@ void ProcessInput(void)
 //     `-> | Camera space |  <-- multiply by view matrix
 //         +--------------+
 //         |    +------------+
-//         `--> |  Clipping  |  <-- clip against the six frustum planes
-//              +------------+
+//         `--> | Projection |  <-- multiply by projection matrix
+//              +------------+      (all three are concatenated into one matrix)
 //              |    +------------+
-//              `--> | Projection |  <-- multiply by projection matrix
+//              `--> |  Clipping  |  <-- clip against the frustum planes in clip space
 //                   +------------+
 //                   |    +-------------+
 //                   `--> | Image space |  <-- apply perspective divide
@@ -365,160 +463,416 @@ void ProcessInput(void)
 //                             +--------------+
 ////////////////////////////////////////////////////////////////////////////
 
+static bool ReserveTransformedVertices(const int numVertices)
+{
+    // make sure the vertices buffers can hold numVertices vertices;
+    // the old content isn't needed so we don't copy it
+    if (numVertices <= s_VerticesCapacity)
+        return true;
+
+    const int capacity = MAX(numVertices, s_VerticesCapacity * 2);
+
+    free(s_VerticesStreams);
+    free(s_VerticesOutcodes);
+
+    s_VerticesStreams  = (float*)malloc(sizeof(float) * 8 * capacity);
+    s_VerticesOutcodes = (Outcode*)malloc(sizeof(Outcode) * capacity);
+
+    if (!s_VerticesStreams || !s_VerticesOutcodes)
+    {
+        fprintf(stderr, "can't allocate memory for %d transformed vertices\n", capacity);
+
+        free(s_VerticesStreams);
+        free(s_VerticesOutcodes);
+        s_VerticesStreams   = NULL;
+        s_VerticesOutcodes  = NULL;
+        s_VerticesCapacity  = 0;
+        return false;
+    }
+
+    float* streams = s_VerticesStreams;
+    g_TransformedVertices = (PointStreams){ streams, streams + capacity, streams + capacity * 2, streams + capacity * 3 };
+    streams += capacity * 4;
+    g_ProjectedVertices   = (PointStreams){ streams, streams + capacity, streams + capacity * 2, streams + capacity * 3 };
+
+    s_VerticesCapacity = capacity;
+    return true;
+}
+
+///////////////////////////////////////////////////////////
+
+static void FreeTransformedVertices(void)
+{
+    free(s_VerticesStreams);
+    free(s_VerticesOutcodes);
+
+    s_VerticesStreams  = NULL;
+    s_VerticesOutcodes = NULL;
+    s_VerticesCapacity = 0;
+
+    g_TransformedVertices = (PointStreams){ NULL, NULL, NULL, NULL };
+    g_ProjectedVertices   = (PointStreams){ NULL, NULL, NULL, NULL };
+}
+
+///////////////////////////////////////////////////////////
+
 void TransformVertices(
-    const Matrix* pWorld,
-    const Matrix* pView,
-    Mesh* pMesh)
+    const Matrix* pWorldViewProj,
+    const Mesh* pMesh,
+    const int firstVertex,
+    const bool isInsideFrustum)
 {
-    // transform all the vertices of the input mesh
-    // first using the world matrix, and then using the view matrix
+    // transform all the vertices of the input mesh into clip space
+    // with the concatenated world-view-projection matrix in a single pass;
+    // each vertex is shared by a few faces so it is transformed
+    // only once, and faces refer to the result by the vertex idx;
+    // 
+    // NOTE: both the backface culling and the clipping work in clip space,
+    //       so we keep clip space vertices; and we also map them into 
+    //       screen space right away, since most of triangles are completely
+    //       inside the frustum and don't need clipping (see outcodes)
+    //
+    // the result is written into the streams starting from firstVertex, so
+    // a few instances of the mesh can be transformed one after another;
+    // if the mesh is known to be inside the frustum its outcodes are all
+    // zeros, so they aren't computed at all
+    const int numVertices = pMesh->numVertices;
+    const int f = firstVertex;
+
+    PointStreams clipVertices   = { g_TransformedVertices.x + f, g_TransformedVertices.y + f, g_TransformedVertices.z + f, g_TransformedVertices.w + f };
+    PointStreams screenVertices = { g_ProjectedVertices.x + f,   g_ProjectedVertices.y + f,   g_ProjectedVertices.z + f,   g_ProjectedVertices.w + f };
+
+    MatrixTransformPoints(pWorldViewProj, &pMesh->positions, &clipVertices, numVertices);
+    if (!isInsideFrustum)
+        ComputeOutcodes(&clipVertices, s_VerticesOutcodes + f, numVertices);
+
+    MatrixTransformPointsProject(&g_ViewportMatrix, &clipVertices, &screenVertices, numVertices);
+
+    g_NumTransformedVertices = f + numVertices;
+    s_MaxNumTransformedVertices = MAX(s_MaxNumTransformedVertices, g_NumTransformedVertices);
+}
 
-    Vec4* vertices = g_TransformedVertices;
+///////////////////////////////////////////////////////////
 
-    // convert all the faces of the mesh from Vec3 into Vec4
-    for (int i = 0, vIdx = 0; i < pMesh->numFaces; ++i)
+static inline Vec4 GetTransformedVertex(const int idx)
+{
+    return (Vec4)
     {
-        const int idx0 = pMesh->faces[i].a;
-        const int idx1 = pMesh->faces[i].b;
-        const int idx2 = pMesh->faces[i].c;
-        
-        const Vec3 v0 = pMesh->vertices[idx0];
-        const Vec3 v1 = pMesh->vertices[idx1];
-        const Vec3 v2 = pMesh->vertices[idx2];
+        g_TransformedVertices.x[idx],
+        g_TransformedVertices.y[idx],
+        g_TransformedVertices.z[idx],
+        g_TransformedVertices.w[idx]
+    };
+}
 
-        vertices[vIdx++] = (Vec4){ v0.x, v0.y, v0.z, 1.0f };
-        vertices[vIdx++] = (Vec4){ v1.x, v1.y, v1.z, 1.0f };
-        vertices[vIdx++] = (Vec4){ v2.x, v2.y, v2.z, 1.0f };
-    }
+///////////////////////////////////////////////////////////
 
-    // transform all the vertices in the mesh using the world matrix
-    for (int i = 0, vIdx = 0; i < pMesh->numFaces; ++i, vIdx += 3)
+static inline Vec4 GetProjectedVertex(const int idx)
+{
+    return (Vec4)
     {
-        MatrixMulVec4(&g_WorldMatrix, vertices[vIdx + 0], &vertices[vIdx + 0]);
-        MatrixMulVec4(&g_WorldMatrix, vertices[vIdx + 1], &vertices[vIdx + 1]);
-        MatrixMulVec4(&g_WorldMatrix, vertices[vIdx + 2], &vertices[vIdx + 2]);
+        g_ProjectedVertices.x[idx],
+        g_ProjectedVertices.y[idx],
+        g_ProjectedVertices.z[idx],
+        g_ProjectedVertices.w[idx]
+    };
+}
+
+///////////////////////////////////////////////////////////
+
+static inline void QueueProjectedFace(
+    const Face* pFace,
+    const int a,                    // idxs of the face vertices in the transformed vertices
+    const int b,
+    const int c,
+    const uint16_t materialIdx)
+{
+    // push the face which doesn't need clipping: just take its
+    // vertices which are already in screen space
+    const Vec4 p0 = GetProjectedVertex(a);
+    const Vec4 p1 = GetProjectedVertex(b);
+    const Vec4 p2 = GetProjectedVertex(c);
+
+    // calculate the light intensity based on face normal and light direction
+    const float lightIntensity = 1.0f; //-Vec3Dot(faceNormal, GetDirectedLightDirection());
+
+    PushRenderTriangle(
+        &g_RenderQueue,
+        &p0, &p1, &p2,
+        pFace->aUV, pFace->bUV, pFace->cUV,
+        pFace->color,
+        lightIntensity,
+        materialIdx);
+}
+
+///////////////////////////////////////////////////////////
+
+static inline void QueueFace(
+    const Face* pFace,
+    const int a,                    // idxs of the face vertices in the transformed vertices
+    const int b,
+    const int c,
+    const int clipPlanes,           // the planes the triangles are clipped against
+    const uint16_t materialIdx)
+{
+    // clip the face if it's needed and push the result into the render queue
+    const u32 triangleColor = pFace->color;
+
+    const int outcode0 = s_VerticesOutcodes[a];
+    const int outcode1 = s_VerticesOutcodes[b];
+    const int outcode2 = s_VerticesOutcodes[c];
+
+    // trivial reject: all the vertices are outside of the same frustum plane
+    if (outcode0 & outcode1 & outcode2 & OUTCODE_FRUSTUM_PLANES)
+        return;
+
+    // the planes which are crossed by the triangle and we have to clip against:
+    // in the guard-band mode the side planes of the frustum are skipped (the 
+    // rasterizer scissors triangles to the screen) and we clip only against
+    // the near/far planes and the guard band
+    const int clipPlanesMask = (outcode0 | outcode1 | outcode2) & clipPlanes;
+
+    // trivial accept: the triangle is completely inside the frustum (or the guard band)
+    if (clipPlanesMask == 0)
+    {
+        QueueProjectedFace(pFace, a, b, c, materialIdx);
+        return;
     }
 
-    // transform all the vertices using the view matrix
-    for (int i = 0, vIdx = 0; i < pMesh->numFaces; ++i, vIdx += 3)
+    // calculate the light intensity based on face normal and light direction
+    const float lightIntensity = 1.0f; //-Vec3Dot(faceNormal, GetDirectedLightDirection());
+
+    // create a polygon from the original transformed triangle to be clipped
+    Polygon polygon = CreatePolygonFromTriangle(
+        GetTransformedVertex(a),
+        GetTransformedVertex(b),
+        GetTransformedVertex(c),
+        pFace->aUV,
+        pFace->bUV,
+        pFace->cUV);
+
+    // clip the polygon only against the crossed planes and 
+    // return a new polygon with potential new vertices
+    ClipPolygonAgainstPlanes(&polygon, clipPlanesMask);
+
+    // map the clip space vertices of the polygon into screen space 
+    // (perspective divide, scaled into the view, with flipped Y and 
+    // moved to the middle of the screen)
+    const Vec4* v = polygon.vertices;
+    const Tex2* t = polygon.texCoords;
+
+    for (int j = 0; j < polygon.numVertices; ++j)
+        MatrixMulVec4Project(&g_ViewportMatrix, polygon.vertices[j], &polygon.vertices[j]);
+
+    // break the polygon into a triangles fan and queue them for rendering
+    for (int j = 1; j < polygon.numVertices - 1; ++j)
     {
-        MatrixMulVec4(&g_ViewMatrix, vertices[vIdx + 0], &vertices[vIdx + 0]);
-        MatrixMulVec4(&g_ViewMatrix, vertices[vIdx + 1], &vertices[vIdx + 1]);
-        MatrixMulVec4(&g_ViewMatrix, vertices[vIdx + 2], &vertices[vIdx + 2]);
+        PushRenderTriangle(
+            &g_RenderQueue,
+            &v[0], &v[j], &v[j + 1],
+            t[0], t[j], t[j + 1],
+            triangleColor,
+            lightIntensity,
+            materialIdx);
     }
 }
 
 ///////////////////////////////////////////////////////////
 
-void ProcessMesh(Mesh* pMesh)
+static Vec4 GetInstanceSpaceCamera(MeshInstance* pInstance)
 {
-    
-    Vec4* vertices = g_TransformedVertices;
-    upng_t* pMeshTexture = pMesh->pTexture;
+    // take the camera into object space for the backface test against the
+    // precomputed faces planes; a mirroring world matrix (odd number of 
+    // negative scale factors) flips the winding, so flip the camera side too
+    const Vec3 objCameraPos = TransformPointToInstanceSpace(pInstance, GetCameraPosition());
+    const Vec3 scale = pInstance->scale;
+    const float side = (scale.x * scale.y * scale.z < 0) ? -1.0f : 1.0f;
+
+    return (Vec4){ side * objCameraPos.x, side * objCameraPos.y, side * objCameraPos.z, side };
+}
 
-    const Vec3 dirLightDirection = {0, -1, 0};//GetDirectedLightDirection();
-    const bool isBackfaceCullEnabled = IsCullBackface();
-    const int numTriangles = (pMesh->numFaces);
+///////////////////////////////////////////////////////////
+
+static bool PrepareBatchInstance(const Mesh* pMesh, MeshInstance* pInstance, BatchInstance* pBatchInstance)
+{
+    // cull the instance by its bounding volumes and transform its vertices
+    // into the streams from pBatchInstance->firstVertex;
+    // return false if the instance isn't visible
+
+    // concatenate the world (cached, it's rebuilt only when the instance is moved),
+    // view and projection matrices once for the whole instance 
+    MatrixMulMatrixRetProd(&g_ViewProjMatrix, GetInstanceWorldMatrix(pInstance), &g_WorldViewProjMatrix);
+
+    // skip the whole instance if its bounding volumes are out of the frustum
+    // (the frustum planes are taken in object space so we can test the
+    // object space bounding volumes as is, even for non-uniform scale)
+    Vec4 frustumPlanes[6];
+    ExtractFrustumPlanes(&g_WorldViewProjMatrix, frustumPlanes);
+
+    if (IsSphereOutsideFrustum(frustumPlanes, pMesh->sphereCenter, pMesh->sphereRadius) ||
+        IsAabbOutsideFrustum(frustumPlanes, pMesh->aabbMin, pMesh->aabbMax))
+        return false;
 
-    // create a world matrix combining scale, rotation and translation matrices;
-    MatrixInitWorld(
-        &pMesh->scale, 
-        &pMesh->rotation, 
-        &pMesh->translation, 
-        &g_WorldMatrix);
+    // if the whole instance is inside the frustum none of its faces needs clipping
+    pBatchInstance->isInsideFrustum = IsAabbInsideFrustum(frustumPlanes, pMesh->aabbMin, pMesh->aabbMax);
 
-    // transform with world, view matrices
-    TransformVertices(&g_WorldMatrix, &g_ViewMatrix, pMesh);
+    TransformVertices(&g_WorldViewProjMatrix, pMesh, pBatchInstance->firstVertex, pBatchInstance->isInsideFrustum);
 
+    pBatchInstance->cameraPos = GetInstanceSpaceCamera(pInstance);
 
-    for (int i = 0, vIdx = 0; i < numTriangles; ++i)
+    return true;
+}
+
+///////////////////////////////////////////////////////////
+
+void ProcessMeshInstances(const Mesh* pMesh, const int* instanceIdxs, const int numInstances)
+{
+    // process a few instances of the same mesh in batches: the visible 
+    // instances of a batch are transformed one after another, and then 
+    // the faces of the mesh are walked only once for the whole batch,
+    // so the face data is fetched from memory once per batch and not
+    // once per instance
+
+    const bool isBackfaceCullEnabled = IsCullBackface();
+    const int numFaces = pMesh->numFaces;
+    const int numVertices = pMesh->numVertices;
+    const int clipPlanes = (IsRenderFlag(RENDER_FLAG_GUARD_BAND)) ? OUTCODE_GUARD_BAND_PLANES : OUTCODE_FRUSTUM_PLANES;
+
+    if (!ReserveTransformedVertices(numVertices * MIN(numInstances, INSTANCE_BATCH_SIZE)))
+        return;
+
+    // all the triangles of the mesh share its render state
+    const uint16_t materialIdx = AddRenderMaterial(&g_RenderQueue, pMesh->pTexture, pMesh->isTextureOpaque);
+
+    for (int first = 0; first < numInstances; first += INSTANCE_BATCH_SIZE)
     {
-        const Face* pFace = pMesh->faces + i;
-        const u32 triangleColor = pFace->color;
+        const int last = MIN(first + INSTANCE_BATCH_SIZE, numInstances);
 
-        Vec4 vertex0 = vertices[vIdx++];
-        Vec4 vertex1 = vertices[vIdx++];
-        Vec4 vertex2 = vertices[vIdx++];
-#if 1
-        // ------------------------------------------------
+        BatchInstance batch[INSTANCE_BATCH_SIZE];
+        int batchSize = 0;
 
-        // calculate the triangle face normal
-        const Vec3 faceNormal = GetTriangleNormal(vertex0, vertex1, vertex2);
- 
-        // backface culling, bypassing triangles which we don't see
-        if (isBackfaceCullEnabled)
+        for (int k = first; k < last; ++k)
         {
-            // find the camera ray vector (pointA => camera_pos)
-            Vec3 cameraRay = Vec3Sub(Vec3Init(0,0,0), Vec3FromVec4(&vertex0));
-            
-            // take the dot product btw the normal and the camera ray;
-            // and if this dot prod is < 0, then we don't display the face
-            // (the triangle is looking away from the camera)
-            if (Vec3Dot(faceNormal, cameraRay) < 0)
-                continue;
+            batch[batchSize].firstVertex = batchSize * numVertices;
+
+            if (PrepareBatchInstance(pMesh, GetMeshInstanceByIdx(instanceIdxs[k]), &batch[batchSize]))
+                batchSize++;
         }
-#endif
-        // ------------------------------------------------
-        
 
-        // create a polygon from the original transformed triangle to be clipped
-        Polygon polygon = CreatePolygonFromTriangle(
-            vertex0,
-            vertex1,
-            vertex2,
-            pFace->aUV,
-            pFace->bUV,
-            pFace->cUV);
-        
-        // clip the polygon and return a new polygon with potential new vertices
-        ClipPolygon(&polygon);
+        for (int i = 0; i < numFaces; ++i)
+        {
+            const Face* pFace = pMesh->faces + i;
+            const Vec4 facePlane = pMesh->facePlanes[i];
+
+            for (int k = 0; k < batchSize; ++k)
+            {
+                // backface culling, bypassing triangles which we don't see
+                if (isBackfaceCullEnabled && IsFaceFacingAway(facePlane, batch[k].cameraPos))
+                    continue;
+
+                const int firstVertex = batch[k].firstVertex;
+                const int a = firstVertex + pFace->a;
+                const int b = firstVertex + pFace->b;
+                const int c = firstVertex + pFace->c;
+
+                if (batch[k].isInsideFrustum)
+                    QueueProjectedFace(pFace, a, b, c, materialIdx);
+                else
+                    QueueFace(pFace, a, b, c, clipPlanes, materialIdx);
+            }
+        } // end loop throught faces of the mesh
+    } // end loop through batches
+}
+
+///////////////////////////////////////////////////////////
+
+static void GroupInstancesByMesh(const int* instanceIdxs, const int numInstances)
+{
+    // put the input idxs of instances into s_InstancesByMesh grouped by 
+    // their meshes (a counting sort by the mesh idx, so the instances of
+    // each mesh remain in the input order)
+    const int numMeshes = GetNumMeshes();
 
-        // after clipping we break the polygon into triangles
-        Triangle trianglesAfterClipping[MAX_NUM_POLYGON_TRIANGLES];
-        int numTrianglesAfterClipping = 0;
+    ArrayClear(s_MeshFirstInstance);
+    ArrayClear(s_InstancesByMesh);
+    s_MeshFirstInstance = ArrayHold(s_MeshFirstInstance, numMeshes + 1, sizeof(int));
+    s_InstancesByMesh   = ArrayHold(s_InstancesByMesh, numInstances, sizeof(int));
 
-        CreateTrianglesFromPolygon(&polygon, trianglesAfterClipping, &numTrianglesAfterClipping);
+    memset(s_MeshFirstInstance, 0, sizeof(int) * (numMeshes + 1));
+
+    for (int i = 0; i < numInstances; ++i)
+        s_MeshFirstInstance[GetMeshInstanceByIdx(instanceIdxs[i])->meshIdx + 1]++;
+
+    for (int m = 0; m < numMeshes; ++m)
+        s_MeshFirstInstance[m + 1] += s_MeshFirstInstance[m];
+
+    // use s_MeshFirstInstance[m] as an insertion position and 
+    // then it's shifted back to the start of the next mesh
+    for (int i = 0; i < numInstances; ++i)
+        s_InstancesByMesh[s_MeshFirstInstance[GetMeshInstanceByIdx(instanceIdxs[i])->meshIdx]++] = instanceIdxs[i];
+
+    for (int m = numMeshes; m > 0; --m)
+        s_MeshFirstInstance[m] = s_MeshFirstInstance[m - 1];
+
+    s_MeshFirstInstance[0] = 0;
+}
+
+///////////////////////////////////////////////////////////
+
+static int CullOccludedInstances(int* instanceIdxs, const int numInstances)
+{
+    // rasterize the occluders among the input instances into the occlusion
+    // buffer and then remove the instances which are hidden behind them
+    // (in place); returns the number of the rest of the instances
+    bool hasOccluders = false;
+
+    for (int i = 0; i < numInstances; ++i)
+    {
+        MeshInstance* pInstance = GetMeshInstanceByIdx(instanceIdxs[i]);
 
-        // loop all the assembled triangles after clipping
-        for (int t = 0; t < numTrianglesAfterClipping; ++t)
+        if (!pInstance->isOccluder)
+            continue;
+
+        // the main pass alpha tests the texels of non opaque textures, so
+        // such a mesh may be seen through and it can't hide anything
+        const Mesh* pMesh = GetMeshPtrByIdx(pInstance->meshIdx);
+
+        if (!pMesh->isTextureOpaque)
+            continue;
+
+        if (!hasOccluders)
         {
-            // create a projected 2D triangle which will be rendered
-            Triangle triangleToRender = trianglesAfterClipping[t];           
+            ClearOcclusionBuffer();
+            hasOccluders = true;
+        }
 
-            // loop all three vertices to perform projection
-            for (int j = 0; j < 3; ++j)
-            {
-                // project the current vertex 
-                MatrixMulVec4Project(
-                    &g_ProjMatrix, 
-                    triangleToRender.points[j], 
-                    &triangleToRender.points[j]);
-
-                // scale into the view
-                triangleToRender.points[j].x *= g_WndHalfWidth;
-                triangleToRender.points[j].y *= g_WndHalfHeight;
-
-                // invert the Y values to account for flipped screen Y coordinate
-                triangleToRender.points[j].y *= -1;
-
-                // translate the projected points to the middle of the screen
-                triangleToRender.points[j].x += g_WndHalfWidth;
-                triangleToRender.points[j].y += g_WndHalfHeight;
-            }
+        Matrix worldViewProj;
+        MatrixMulMatrixRetProd(&g_ViewProjMatrix, GetInstanceWorldMatrix(pInstance), &worldViewProj);
+        // the occluder must hide only what it hides in the final image,
+        // so its back faces are skipped if they are culled there
+        const Vec4 cameraPos = GetInstanceSpaceCamera(pInstance);
 
-            triangleToRender.color = triangleColor;
-            triangleToRender.pTexture = pMeshTexture;
-            
+        RasterizeOccluder(
+            pMesh,
+            &worldViewProj,
+            (IsCullBackface()) ? &cameraPos : NULL);
+    }
+
+    if (!hasOccluders)
+        return numInstances;
+
+    int numVisible = 0;
+
+    for (int i = 0; i < numInstances; ++i)
+    {
+        Vec3 aabbMin, aabbMax;
+        GetInstanceWorldAabb(GetMeshInstanceByIdx(instanceIdxs[i]), &aabbMin, &aabbMax);
 
-            // calculate the light intensity based on face normal and light direction
-            triangleToRender.lightIntensity = 1.0f; //-Vec3Dot(faceNormal, GetDirectedLightDirection());
-         
-            // save the projected triangle in the arr of triangles to render
-            g_TrianglesToRender[g_NumTrianglesToRender] = triangleToRender;
-            g_NumTrianglesToRender++;
+        if (!IsAabbOccluded(&g_ViewProjMatrix, aabbMin, aabbMax))
+            instanceIdxs[numVisible++] = instanceIdxs[i];
+    }
 
-        } // end loop through triangles after clipping
-    } // end loop throught triangles of the mesh
+    return numVisible;
 }
 
 ///////////////////////////////////////////////////////////
@@ -533,8 +887,8 @@ void Update(void)
     // normalize the directed light vector, if we don't do this
     // we might explode the brightness value of the triangles colors
     //Vec3Normalize(&g_LightDir.direction);
-    // reset the number of faces to render for this frame    
-    g_NumTrianglesToRender = 0;
+    // reset the number of faces to render for this frame (keep the memory)
+    ClearRenderQueue(&g_RenderQueue);
 
     g_NumTransformedVertices = 0;
     // update transformation of the mesh
@@ -549,76 +903,139 @@ void Update(void)
     const Vec3 worldUp = { 0, 1, 0 };
     const Vec3 target = GetCameraLookAtTarget();
     MatrixView(GetCameraPosition(), target, worldUp, &g_ViewMatrix);
+    MatrixMulMatrixRetProd(&g_ProjMatrix, &g_ViewMatrix, &g_ViewProjMatrix);
+
+    // cull the placed meshes (instances) against the frustum using
+    // the scene BVH and then against the occluders, then update the
+    // visible instances for this frame and store all the visible
+    // triangles of these meshes for rendering; the instances of each
+    // mesh are processed together in batches
+    UpdateSceneBvh();
+    int* visibleInstances = CullSceneBvh(&g_ViewProjMatrix);
+    int numVisibleInstances = ArrayLength(visibleInstances);
+
+    if (IsRenderFlag(RENDER_FLAG_OCCLUSION_CULL))
+        numVisibleInstances = CullOccludedInstances(visibleInstances, numVisibleInstances);
+
+    GroupInstancesByMesh(visibleInstances, numVisibleInstances);
 
-    // update the all meshes for this frame
-    // and load store all the visible triangles of 
-    // these meshes for rendering
     for (int meshIdx = 0; meshIdx < GetNumMeshes(); ++meshIdx)
     {
-        ProcessMesh(GetMeshPtrByIdx(meshIdx));
+        const int first = s_MeshFirstInstance[meshIdx];
+        const int numInstances = s_MeshFirstInstance[meshIdx + 1] - first;
+
+        if (numInstances > 0)
+            ProcessMeshInstances(GetMeshPtrByIdx(meshIdx), s_InstancesByMesh + first, numInstances);
     }
+
+    s_MaxNumTrianglesToRender = MAX(s_MaxNumTrianglesToRender, g_RenderQueue.numTriangles);
 }
 
 ///////////////////////////////////////////////////////////
 
-void RenderTriangles(const Triangle* triangles, const int numTriangles)
+void RenderTileVisibility(Tile* pTile, const RenderQueue* pQueue)
 {
-    // render an array of triangles according to chosen render method
+    // render textured triangles of the tile in two passes: the depth pass
+    // finds the visible triangle of each pixel, and then the shading pass
+    // textures each pixel once (the z-buffer of the tile is already cleared)
 
-    const u32 red   = 0xFF0000FF;   // ABGR
-    //const u32 white = 0xFFFFFFFF;
-    //const u32 black = 0xFF000000;
-    //const u32 green = 0xFF00FF00;
+    const Rect* pRect = &pTile->rect;
+    const int* idxs = pTile->triangleIdxs;
+    const int numTriangles = ArrayLength(pTile->triangleIdxs);
+
+    if (numTriangles == 0)
+        return;
+
+    // the memory of the visibility triangles is kept from frame to frame
+    ArrayClear(pTile->visTriangles);
+    pTile->visTriangles = ArrayHold(pTile->visTriangles, numTriangles, sizeof(VisibilityTriangle));
+
+    ClearIdBufferRect(pRect);
+
+    // an id of the triangle is its idx in the tile
+    for (int i = 0; i < numTriangles; ++i)
+        DrawTriangleVisibility(pQueue, idxs[i], (uint32_t)i, pRect, pTile->visTriangles + i);
+
+    ShadeVisibilityBuffer(pTile->visTriangles, pRect);
+}
+
+///////////////////////////////////////////////////////////
+
+void RenderTile(Tile* pTile, const RenderQueue* pQueue)
+{
+    // clear and render the part of the frame inside a single tile;
+    // the tile rect is used to clip the rasterization of the triangles
+
+    const Rect* pRect = &pTile->rect;
+    const int* idxs = pTile->triangleIdxs;
+    const int numTriangles = ArrayLength(pTile->triangleIdxs);
+
+    ClearColorBufferRect(0xFFAAAA00, pRect);  // ABGR
+
+    // the painter's algorithm doesn't use the z-buffer
+    if (!IsRenderFlag(RENDER_FLAG_PAINTER))
+        ClearZBufferRect(pRect);
+
+    // draw the background grid (grey dots)
+    DrawGridRect(pRect);
 
     // draw filled triangles (solid color)
     if (ShouldRenderFilledTriangles())
     {
         for (int i = 0; i < numTriangles; ++i)
-        {
-            const Vec4* p = triangles[i].points;   // an arr of three Vec2 points
-
-            DrawFilledTriangle(
-                p[0].x, p[0].y, p[0].w,
-                p[1].x, p[1].y, p[1].w,
-                p[2].x, p[2].y, p[2].w,
-                triangles[i].lightIntensity,
-                triangles[i].color);
-        }        
+            DrawFilledTriangle(pQueue, idxs[i], pRect);
+    }
+
+    // draw textured triangles in two passes (the painter's algorithm has no depth)
+    if (ShouldRenderTexturedTriangles() &&
+        IsRenderFlag(RENDER_FLAG_VISBUFFER) &&
+        !IsRenderFlag(RENDER_FLAG_PAINTER))
+    {
+        RenderTileVisibility(pTile, pQueue);
     }
 
     // draw textured triangle
-    if (ShouldRenderTexturedTriangles())
+    else if (ShouldRenderTexturedTriangles())
     {
         for (int i = 0; i < numTriangles; ++i)
-        {
-            const Triangle* tr = triangles + i;
-
-            const Vec4* p   = tr->points;    // points of the projected triangle
-            const Tex2* tex = tr->texCoords;     
-
-            DrawTexturedTriangle(
-                p[0].x, p[0].y, p[0].z, p[0].w,
-                p[1].x, p[1].y, p[1].z, p[1].w,
-                p[2].x, p[2].y, p[2].z, p[2].w,
-                tex[0].u, tex[0].v,
-                tex[1].u, tex[1].v,
-                tex[2].u, tex[2].v,
-                tr->lightIntensity,
-                tr->pTexture);
-        }
+            DrawTexturedTriangle(pQueue, idxs[i], pRect);
     }
+}
+
+///////////////////////////////////////////////////////////
+
+void RenderTileJob(const int tileIdx, void* pData)
+{
+    // a job for the thread pool: each tile is owned by a single thread
+    // so there is no need to lock the color buffer and z-buffer
+    RenderTile(GetTileByIdx(tileIdx), (const RenderQueue*)pData);
+}
+
+///////////////////////////////////////////////////////////
+
+void RenderWireframe(const RenderQueue* pQueue)
+{
+    // render wireframe and vertices of the triangles over the whole screen
+
+    const u32 red   = 0xFF0000FF;   // ABGR
+    //const u32 white = 0xFFFFFFFF;
+    //const u32 black = 0xFF000000;
+    //const u32 green = 0xFF00FF00;
+
+    const int numTriangles = pQueue->numTriangles;
 
     // draw unfilled triangle (wireframe)
     if (ShouldRenderWireframe())
     {
         for (int i = 0; i < numTriangles; ++i)
         {
-            const Vec4* p = triangles[i].points;   // an arr of three Vec2 points
+            const int32_t* x = pQueue->x + i * 3;   // 28.4 fixed-point screen coords
+            const int32_t* y = pQueue->y + i * 3;
             
             DrawTriangle(
-                p[0].x, p[0].y, 
-                p[1].x, p[1].y, 
-                p[2].x, p[2].y, 
+                SubpixelToPixel(x[0]), SubpixelToPixel(y[0]), 
+                SubpixelToPixel(x[1]), SubpixelToPixel(y[1]), 
+                SubpixelToPixel(x[2]), SubpixelToPixel(y[2]), 
                 red);
         }      
     }
@@ -626,13 +1043,9 @@ void RenderTriangles(const Triangle* triangles, const int numTriangles)
     // draw vertices
     if (ShouldRenderWireVertices())
     {
-        for (int i = 0; i < numTriangles; ++i)
+        for (int i = 0; i < numTriangles * 3; ++i)
         {
-            const Vec4* p = triangles[i].points;   // and array of three Vec2 points
-            DrawRect(p[0].x, p[0].y, 3, 3, red);   // vertex A
-            DrawRect(p[1].x, p[1].y, 3, 3, red);   // vertex B
-            DrawRect(p[2].x, p[2].y, 3, 3, red);   // vertex C
-     
+            DrawRect(SubpixelToPixel(pQueue->x[i]), SubpixelToPixel(pQueue->y[i]), 3, 3, red);
         }
     }
 }
@@ -642,14 +1055,25 @@ void RenderTriangles(const Triangle* triangles, const int numTriangles)
 void Render(void)
 {   
     //SDL_RenderClear(g_pRenderer);
-    ClearColorBuffer(0xFFAAAA00);  // ABGR black
-    ClearZBuffer();
 
-    // draw the background grid (grey dots)
-    DrawGrid();
+    // sort the triangles by depth: from front to back so the z-test rejects
+    // the most of hidden pixels, or from back to front for the painter's algorithm
+    const int numTriangles = g_RenderQueue.numTriangles;
+    const int sortOrder = (IsRenderFlag(RENDER_FLAG_PAINTER)) ? SORT_BACK_TO_FRONT : SORT_FRONT_TO_BACK;
 
-    // loop all projected triangles and render them
-    RenderTriangles(g_TrianglesToRender, g_NumTrianglesToRender);
+    ArrayClear(g_TrianglesDrawOrder);
+    g_TrianglesDrawOrder = ArrayHold(g_TrianglesDrawOrder, numTriangles, sizeof(int));
+    SortTriangles(g_RenderQueue.depth, numTriangles, sortOrder, g_TrianglesDrawOrder);
+
+    // sort all the projected triangles into screen tiles in the order of drawing
+    BinTriangles(&g_RenderQueue, g_TrianglesDrawOrder);
+
+    // clear and rasterize the frame tile by tile, so the color and
+    // depth of the current tile stay in the cache; tiles are
+    // rendered in parallel by the threads of the pool
+    RunJobs(RenderTileJob, &g_RenderQueue, GetNumTiles());
+
+    RenderWireframe(&g_RenderQueue);
 
     RenderColorBuffer();
 }
@@ -671,6 +1095,13 @@ void FreeAssetResources(Mesh* pMesh)
 
     if (pMesh->vertices)
         ArrayFree((void**)&(pMesh->vertices));
+
+    // all the SoA streams live in a single allocation
+    free(pMesh->positions.x);
+    pMesh->positions = (PointStreams){ NULL, NULL, NULL, NULL };
+
+    free(pMesh->facePlanes);
+    pMesh->facePlanes = NULL;
 }
 
 ///////////////////////////////////////////////////////////
@@ -682,4 +1113,25 @@ void FreeResources(void)
     {
         FreeAssetResources(GetMeshPtrByIdx(meshIdx));
     }
+
+    FreeMeshes();
+    FreeSceneBvh();
+    FreeOcclusionBuffer();
+
+    FreeThreadPool();
+    FreeTiles();
+    FreeSortBuffers();
+
+    FreeTransformedVertices();
+
+    FreeRenderQueue(&g_RenderQueue);
+
+    if (g_TrianglesDrawOrder)
+        ArrayFree((void**)&g_TrianglesDrawOrder);
+
+    if (s_InstancesByMesh)
+        ArrayFree((void**)&s_InstancesByMesh);
+
+    if (s_MeshFirstInstance)
+        ArrayFree((void**)&s_MeshFirstInstance);
 }
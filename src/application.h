@@ -8,6 +8,8 @@
 #include "display.h"
 #include "vector.h"
 #include "mesh.h"
+#include "scene_bvh.h"
+#include "occlusion.h"
 #include "matrix.h"
 #include "camera.h"
 #include "triangle.h"
@@ -15,12 +17,16 @@
 #include "texture.h"
 #include "math_common.h"
 #include "clipping.h"
+#include "tile.h"
+#include "render_queue.h"
+#include "thread_pool.h"
 #include "upng.h"
 
 // ==================================================================
 // array of triangles that should be rendered frame by frame
 // ==================================================================
-extern Triangle g_TrianglesToRender[10000];
+extern RenderQueue g_RenderQueue;
+extern int*        g_TrianglesDrawOrder;   // dynamic arr (see array.h)
 
 
 // ==================================================================
@@ -44,6 +44,15 @@ int ArrayLength(void* array)
 
 ///////////////////////////////////////////////////////////
 
+void ArrayClear(void* array)
+{
+    // reset the number of occupied elements but keep the allocated memory
+    if (array != NULL)
+        ARRAY_OCCUPIED(array) = 0;
+}
+
+///////////////////////////////////////////////////////////
+
 void ArrayFree(void** array)
 {
     if (array != NULL)
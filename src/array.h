@@ -14,6 +14,7 @@
 
 void* ArrayHold(void* array, const int count, const int itemSize);
 int ArrayLength(void* array);
+void ArrayClear(void* array);
 void ArrayFree(void** array);
 
 #endif
@@ -1,54 +1,35 @@
 #include "clipping.h"
 #include "math_common.h"
+#include "simd.h"
 #include <math.h>
 
 
-#define NUM_PLANES 6
-Plane g_FrustumPlanes[NUM_PLANES];
-
-
-void InitFrustumPlanes(
-    const float fovX,
-    const float fovY,
-    const float nearZ, 
-    const float farZ)
+// ==================================================================
+// clip space planes: a point (x,y,z,w) is inside of the plane (a,b,c,d)
+// if (a*x + b*y + c*z + d*w) > 0; so the planes are just the rows of 
+// the canonical view volume inequalities, e.g. x >= -w  =>  x + w >= 0
+// ==================================================================
+static const Vec4 s_ClipPlanes[NUM_CLIP_PLANES] =
 {
-    // each frustum plane is defined by a point and a normal vector;
-    // so here we compute each frustum plane params;
-
-    // horizontal (by X)
-    const float sx = sinf(fovX / 2);
-    const float cx = cosf(fovX / 2);
-
-    // vertical (by Y)
-    const float sy = sinf(fovY / 2);
-    const float cy = cosf(fovY / 2);
-
-    const Vec3 origin = { 0,0,0 };
-
-    // left plane: P=(0,0,0), N=(cos(fov/2), 0, sin(fov/2))
-    g_FrustumPlanes[LEFT_FRUSTUM_PLANE].point    = origin;
-    g_FrustumPlanes[LEFT_FRUSTUM_PLANE].normal   = Vec3Init(cx, 0, sx);
+    {  1,  0,  0,  1 },                 // left:    x + w >= 0
+    { -1,  0,  0,  1 },                 // right:  -x + w >= 0
+    {  0, -1,  0,  1 },                 // top:    -y + w >= 0
+    {  0,  1,  0,  1 },                 // bottom:  y + w >= 0
+    {  0,  0,  1,  0 },                 // near:    z >= 0
+    {  0,  0, -1,  1 },                 // far:    -z + w >= 0
+
+    {  1,  0,  0,  GUARD_BAND_SCALE },  // the same side planes
+    { -1,  0,  0,  GUARD_BAND_SCALE },  // but for the guard band:
+    {  0, -1,  0,  GUARD_BAND_SCALE },  // |x| <= GUARD_BAND_SCALE * w
+    {  0,  1,  0,  GUARD_BAND_SCALE },  // |y| <= GUARD_BAND_SCALE * w
+};
 
-    // right plane: P=(0,0,0), N=(-cos(fov/2), 0, sin(fov/2))
-    g_FrustumPlanes[RIGHT_FRUSTUM_PLANE].point   = origin;
-    g_FrustumPlanes[RIGHT_FRUSTUM_PLANE].normal  = Vec3Init(-cx, 0, sx);
-
-    // top plane: P=(0,0,0), N=(0, -cos(fov/2), sin(fov/2))
-    g_FrustumPlanes[TOP_FRUSTUM_PLANE].point     = origin;
-    g_FrustumPlanes[TOP_FRUSTUM_PLANE].normal    = Vec3Init(0, -cy, sy);
-
-    // bottom plane: P=(0,0,0), N=(0, cos(fov/2), sin(fov/2))
-    g_FrustumPlanes[BOTTOM_FRUSTUM_PLANE].point  = origin;
-    g_FrustumPlanes[BOTTOM_FRUSTUM_PLANE].normal = Vec3Init(0, cy, sy);
-
-    // near plane: P=(0,0,nearZ), N=(0,0,1)
-    g_FrustumPlanes[NEAR_FRUSTUM_PLANE].point    = Vec3Init(0, 0, nearZ);
-    g_FrustumPlanes[NEAR_FRUSTUM_PLANE].normal   = Vec3Init(0, 0, 1);
+///////////////////////////////////////////////////////////
 
-    // far plane: P=(0,0,farZ), N=(0,0,-1)
-    g_FrustumPlanes[FAR_FRUSTUM_PLANE].point     = Vec3Init(0, 0, farZ);
-    g_FrustumPlanes[FAR_FRUSTUM_PLANE].normal    = Vec3Init(0, 0, -1);
+static inline float GetPlaneDistance(const Vec4 plane, const Vec4 v)
+{
+    // a signed distance (scaled) from the clip space plane to the point
+    return (plane.x * v.x) + (plane.y * v.y) + (plane.z * v.z) + (plane.w * v.w);
 }
 
 ///////////////////////////////////////////////////////////
@@ -63,12 +44,7 @@ Polygon CreatePolygonFromTriangle(
 {
     Polygon polygon = 
     {
-        .vertices = 
-        {
-            (Vec3){ v0.x, v0.y, v0.z },
-            (Vec3){ v1.x, v1.y, v1.z },
-            (Vec3){ v2.x, v2.y, v2.z },
-        },
+        .vertices = { v0, v1, v2 },
         .texCoords = { t0, t1, t2 },
         .numVertices = 3
     };
@@ -78,8 +54,8 @@ Polygon CreatePolygonFromTriangle(
 
 ///////////////////////////////////////////////////////////
 /*
-                        * Q1        dotQ1 = dot(n, (Q1-P))
-         _ N            |           dotQ2 = dot(n, (Q2-P))
+                        * Q1        dotQ1 = dot(plane, Q1)
+         _ N            |           dotQ2 = dot(plane, Q2)
         /|\             |
          |              | I
   -------*--------------*---------- plane
@@ -92,30 +68,31 @@ Polygon CreatePolygonFromTriangle(
 void ClipPolygonAgainstPlane(Polygon* pPolygon, const int planeType)
 {
     // clip an input polygon agains a frustum plane of input type
-    // and return modified polygon stored in the input polygon param; 
+    // and return modified polygon stored in the input polygon param;
+    // clip space is a linear transformation of view space, so all the 
+    // components (including w) are interpolated linearly as well
 
-    const Vec3 planePoint  = g_FrustumPlanes[planeType].point;
-    const Vec3 planeNormal = g_FrustumPlanes[planeType].normal;
+    const Vec4 plane = s_ClipPlanes[planeType];
 
     // the array of inside vertices (are in positive half space) that will be part of the final polygon returned via parameter
-    Vec3 insideVertices[MAX_NUM_POLYGON_VERTICES];
+    Vec4 insideVertices[MAX_NUM_POLYGON_VERTICES];
     Tex2 insideTexCoords[MAX_NUM_POLYGON_VERTICES];
     int numInsideVertices = 0;
 
     // start current and previous vertex with the first and last polygon vertices and do the same for texture coords 
-    Vec3* pCurrVertex   = &pPolygon->vertices[0];
-    Vec3* pPrevVertex   = &pPolygon->vertices[pPolygon->numVertices - 1];
+    Vec4* pCurrVertex   = &pPolygon->vertices[0];
+    Vec4* pPrevVertex   = &pPolygon->vertices[pPolygon->numVertices - 1];
     Tex2* pCurrTexCoord = &pPolygon->texCoords[0];
     Tex2* pPrevTexCoord = &pPolygon->texCoords[pPolygon->numVertices - 1];
 
     // calculate the dotQ1 (for the previous vertex)
-    float prevDot = Vec3Dot(Vec3Sub(*pPrevVertex, planePoint), planeNormal);
+    float prevDot = GetPlaneDistance(plane, *pPrevVertex);
 
     // loop while the current vertex is different that the last vertex
     while (pCurrVertex != &pPolygon->vertices[pPolygon->numVertices])
     {
         // calcute the dotQ2 (for the current vertex)
-        float currDot = Vec3Dot(Vec3Sub(*pCurrVertex, planePoint), planeNormal);
+        float currDot = GetPlaneDistance(plane, *pCurrVertex);
 
         // if we changed from inside to outside (positive/negative half space) or vise-versa
         if (currDot * prevDot < 0)
@@ -124,11 +101,12 @@ void ClipPolygonAgainstPlane(Polygon* pPolygon, const int planeType)
             const float t = prevDot / (prevDot - currDot);
             
             // calculate the intersection point:   I = Q1 + t(Q2-Q1)
-            Vec3 intersectionPoint = 
+            Vec4 intersectionPoint = 
             {
                 Lerp(pPrevVertex->x, pCurrVertex->x, t),
                 Lerp(pPrevVertex->y, pCurrVertex->y, t),
                 Lerp(pPrevVertex->z, pCurrVertex->z, t),
+                Lerp(pPrevVertex->w, pCurrVertex->w, t),
             };
 
             // use the lerp formula to get the interpolated U and V
@@ -173,18 +151,167 @@ void ClipPolygonAgainstPlane(Polygon* pPolygon, const int planeType)
 
 ///////////////////////////////////////////////////////////
 
+void ComputeOutcodes(
+    const PointStreams* points, 
+    Outcode* outcodes,
+    const int count)
+{
+    // compute an outcode for each input (clip space) point;
+    // the plane test is the same as in ClipPolygonAgainstPlane,
+    // so a point with an unset bit is never clipped by that plane
+
+    int i = 0;
+
+#if SIMD_ENABLED
+    // the same arithmetic as GetPlaneDistance but for a few points at once
+    const SimdFloat zero = SimdSetF(0.0f);
+
+    for (; i + SIMD_WIDTH <= count; i += SIMD_WIDTH)
+    {
+        const SimdFloat x = SimdLoadF(points->x + i);
+        const SimdFloat y = SimdLoadF(points->y + i);
+        const SimdFloat z = SimdLoadF(points->z + i);
+        const SimdFloat w = SimdLoadF(points->w + i);
+
+        SimdInt outcode = SimdSetI(0);
+
+        for (int planeType = 0; planeType < NUM_CLIP_PLANES; ++planeType)
+        {
+            const Vec4 plane = s_ClipPlanes[planeType];
+
+            const SimdFloat dot = SimdAddF(SimdAddF(SimdAddF(
+                SimdMulF(SimdSetF(plane.x), x),
+                SimdMulF(SimdSetF(plane.y), y)),
+                SimdMulF(SimdSetF(plane.z), z)),
+                SimdMulF(SimdSetF(plane.w), w));
+
+            // dot <= 0 is the same as !(0 < dot) (there are no NaNs)
+            const SimdInt isOutside = SimdAndNotI(SimdLessF(zero, dot), SimdSetI(1 << planeType));
+            outcode = SimdOrI(outcode, isOutside);
+        }
+
+        int32_t lanes[SIMD_WIDTH];
+        SimdStoreI(lanes, outcode);
+
+        for (int k = 0; k < SIMD_WIDTH; ++k)
+            outcodes[i + k] = (Outcode)lanes[k];
+    }
+#endif
+
+    // compute outcodes of the rest of points one by one
+    for (; i < count; ++i)
+    {
+        const Vec4 point = { points->x[i], points->y[i], points->z[i], points->w[i] };
+        Outcode outcode = 0;
+
+        for (int planeType = 0; planeType < NUM_CLIP_PLANES; ++planeType)
+        {
+            const float dot = GetPlaneDistance(s_ClipPlanes[planeType], point);
+            outcode |= (Outcode)((dot <= 0) << planeType);
+        }
+
+        outcodes[i] = outcode;
+    }
+}
+
+///////////////////////////////////////////////////////////
+
+void ExtractFrustumPlanes(const Matrix* m, Vec4 planes[6])
+{
+    // since clip = M * v, a clip space plane p gives the plane p * M 
+    // in the space of v (Gribb-Hartmann frustum planes extraction)
+    for (int i = 0; i < 6; ++i)
+    {
+        const Vec4 p = s_ClipPlanes[i];
+
+        planes[i].x = (p.x * m->m00) + (p.y * m->m10) + (p.z * m->m20) + (p.w * m->m30);
+        planes[i].y = (p.x * m->m01) + (p.y * m->m11) + (p.z * m->m21) + (p.w * m->m31);
+        planes[i].z = (p.x * m->m02) + (p.y * m->m12) + (p.z * m->m22) + (p.w * m->m32);
+        planes[i].w = (p.x * m->m03) + (p.y * m->m13) + (p.z * m->m23) + (p.w * m->m33);
+    }
+}
+
+///////////////////////////////////////////////////////////
+
+bool IsSphereOutsideFrustum(const Vec4 planes[6], const Vec3 center, const float radius)
+{
+    // the planes aren't normalized, so scale the radius by the normal length
+    for (int i = 0; i < 6; ++i)
+    {
+        const Vec4 p = planes[i];
+        const float dist = (p.x * center.x) + (p.y * center.y) + (p.z * center.z) + p.w;
+        const float normalLength = sqrtf((p.x * p.x) + (p.y * p.y) + (p.z * p.z));
+
+        if (dist + radius * normalLength <= 0)
+            return true;
+    }
+
+    return false;
+}
+
+///////////////////////////////////////////////////////////
+
+bool IsAabbOutsideFrustum(const Vec4 planes[6], const Vec3 minP, const Vec3 maxP)
+{
+    // test only the corner of the box which is the farthest along
+    // the plane normal: if it is outside then the whole box is outside
+    for (int i = 0; i < 6; ++i)
+    {
+        const Vec4 p = planes[i];
+
+        const float x = (p.x > 0) ? maxP.x : minP.x;
+        const float y = (p.y > 0) ? maxP.y : minP.y;
+        const float z = (p.z > 0) ? maxP.z : minP.z;
+
+        if ((p.x * x) + (p.y * y) + (p.z * z) + p.w <= 0)
+            return true;
+    }
+
+    return false;
+}
+
+///////////////////////////////////////////////////////////
+
+bool IsAabbInsideFrustum(const Vec4 planes[6], const Vec3 minP, const Vec3 maxP)
+{
+    // test only the corner of the box which is the nearest along
+    // the plane normal: if it is inside then the whole box is inside
+    for (int i = 0; i < 6; ++i)
+    {
+        const Vec4 p = planes[i];
+
+        const float x = (p.x > 0) ? minP.x : maxP.x;
+        const float y = (p.y > 0) ? minP.y : maxP.y;
+        const float z = (p.z > 0) ? minP.z : maxP.z;
+
+        if ((p.x * x) + (p.y * y) + (p.z * z) + p.w <= 0)
+            return false;
+    }
+
+    return true;
+}
+
+///////////////////////////////////////////////////////////
+
 void ClipPolygon(Polygon* pPolygon)
 {
     // clip input polygon agains all the 6 frustum planes
-    
-    ClipPolygonAgainstPlane(pPolygon, LEFT_FRUSTUM_PLANE);
-    ClipPolygonAgainstPlane(pPolygon, RIGHT_FRUSTUM_PLANE);
+    ClipPolygonAgainstPlanes(pPolygon, OUTCODE_FRUSTUM_PLANES);
+}
+
+///////////////////////////////////////////////////////////
 
-    ClipPolygonAgainstPlane(pPolygon, TOP_FRUSTUM_PLANE);
-    ClipPolygonAgainstPlane(pPolygon, BOTTOM_FRUSTUM_PLANE);
+void ClipPolygonAgainstPlanes(Polygon* pPolygon, const int planesMask)
+{
+    // clip input polygon only against the planes which are set in the mask
+    // (usually the OR of outcodes of the polygon vertices);
+    // the planes order is the same as for clipping against all of them
 
-    ClipPolygonAgainstPlane(pPolygon, NEAR_FRUSTUM_PLANE);
-    ClipPolygonAgainstPlane(pPolygon, FAR_FRUSTUM_PLANE);
+    for (int planeType = 0; planeType < NUM_CLIP_PLANES; ++planeType)
+    {
+        if ((planesMask & (1 << planeType)) && (pPolygon->numVertices > 0))
+            ClipPolygonAgainstPlane(pPolygon, planeType);
+    }
 }
 
 ///////////////////////////////////////////////////////////
@@ -203,13 +330,9 @@ void CreateTrianglesFromPolygon(
 
     for (int i = 0; i < *pNumTriangles; ++i)
     {
-        const Vec3 v0 = pPolygon->vertices[0];
-        const Vec3 v1 = pPolygon->vertices[i + 1];
-        const Vec3 v2 = pPolygon->vertices[i + 2];
-
-        triangles[i].points[0] = (Vec4){ v0.x, v0.y, v0.z, 1.0f };
-        triangles[i].points[1] = (Vec4){ v1.x, v1.y, v1.z, 1.0f };
-        triangles[i].points[2] = (Vec4){ v2.x, v2.y, v2.z, 1.0f };
+        triangles[i].points[0] = pPolygon->vertices[0];
+        triangles[i].points[1] = pPolygon->vertices[i + 1];
+        triangles[i].points[2] = pPolygon->vertices[i + 2];
 
         triangles[i].texCoords[0] = pPolygon->texCoords[0];
         triangles[i].texCoords[1] = pPolygon->texCoords[i + 1];
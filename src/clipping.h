@@ -9,17 +9,30 @@
 //              3. triangles which are inside the frustum volume
 //                 remain the same
 //
+//              clipping is done in homogeneous clip space (after the
+//              projection matrix but before the perspective divide),
+//              where the frustum is -w <= x <= w, -w <= y <= w, 0 <= z <= w
+//
 // Created:     05.03.25  by DimaSkup
 // ==================================================================
 #ifndef CLIPPING_H
 #define CLIPPING_H
 
+#include <stdint.h>
 #include "vector.h"
+#include "matrix.h"
 #include "triangle.h"
 
 #define MAX_NUM_POLYGON_VERTICES  10
 #define MAX_NUM_POLYGON_TRIANGLES 8   // MAX_NUM_POLYGON_VERTICES - 2
 
+// the guard band is GUARD_BAND_SCALE times wider and higher than the 
+// frustum (in NDC); triangles which cross the side planes of the frustum
+// but stay inside the guard band aren't clipped, the rasterizer just
+// scissors them to the screen (it keeps the band well within the 
+// range of 28.4 fixed-point and float precision)
+#define GUARD_BAND_SCALE 8.0f
+
 enum 
 {
     LEFT_FRUSTUM_PLANE,
@@ -27,29 +40,34 @@ enum
     TOP_FRUSTUM_PLANE,
     BOTTOM_FRUSTUM_PLANE,
     NEAR_FRUSTUM_PLANE,
-    FAR_FRUSTUM_PLANE
+    FAR_FRUSTUM_PLANE,
+
+    LEFT_GUARD_BAND_PLANE,
+    RIGHT_GUARD_BAND_PLANE,
+    TOP_GUARD_BAND_PLANE,
+    BOTTOM_GUARD_BAND_PLANE,
+
+    NUM_CLIP_PLANES
 };
 
-typedef struct
-{
-    Vec3 point;
-    Vec3 normal;
-} Plane;
+// an outcode has a bit (1 << planeType) set for each plane a vertex
+// is outside of (or lies on), so if all three vertices of a triangle 
+// share a frustum bit it is out of the frustum, and if no bits of the 
+// planes we clip against are set it needs no clipping at all
+typedef uint16_t Outcode;
+
+#define OUTCODE_FRUSTUM_PLANES    0x3F
+#define OUTCODE_GUARD_BAND_PLANES \
+    ((1 << NEAR_FRUSTUM_PLANE) | (1 << FAR_FRUSTUM_PLANE) | (0xF << LEFT_GUARD_BAND_PLANE))
 
 typedef struct
 {
-    Vec3 vertices[MAX_NUM_POLYGON_VERTICES];
+    Vec4 vertices[MAX_NUM_POLYGON_VERTICES];    // clip space vertices
     Tex2 texCoords[MAX_NUM_POLYGON_VERTICES];
     int numVertices;
 } Polygon;
 
 
-void InitFrustumPlanes(
-    const float fovX, 
-    const float fovY, 
-    const float nearZ, 
-    const float farZ);
-
 Polygon CreatePolygonFromTriangle(
     const Vec4 v0, 
     const Vec4 v1, 
@@ -58,7 +76,22 @@ Polygon CreatePolygonFromTriangle(
     const Tex2 t1, 
     const Tex2 t2);
 
+// compute outcodes of clip space points (all the x/y/z/w streams are required)
+void ComputeOutcodes(const PointStreams* points, Outcode* outcodes, const int count);
+
+// frustum culling of bounding volumes: the planes are the 6 frustum planes
+// in the space which is transformed into clip space by the matrix (e.g. 
+// object space for world-view-projection); a volume is outside only if 
+// all of its points are outside of (or on) the same plane
+void ExtractFrustumPlanes(const Matrix* pMatrix, Vec4 planes[6]);
+bool IsSphereOutsideFrustum(const Vec4 planes[6], const Vec3 center, const float radius);
+bool IsAabbOutsideFrustum(const Vec4 planes[6], const Vec3 minP, const Vec3 maxP);
+
+// the box is completely inside the frustum (so none of its triangles needs clipping)
+bool IsAabbInsideFrustum(const Vec4 planes[6], const Vec3 minP, const Vec3 maxP);
+
 void ClipPolygon(Polygon* pPolygon);
+void ClipPolygonAgainstPlanes(Polygon* pPolygon, const int planesMask);
 void ClipPolygonAgainstPlane(Polygon* pPolygon, const int planeType);
 
 void CreateTrianglesFromPolygon(
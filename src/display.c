@@ -1,11 +1,15 @@
 #include "display.h"
 #include "math_common.h"
+#include "simd.h"
+#include <string.h>
 
 // ==========================
 // definitions
 // ==========================
 static enum CullMethod   g_CullMethod   = 0;
 static enum RenderMethod g_RenderMethod = 0;
+static int               g_RenderFlags  = 0;
+static int               g_SubdivSpanLength = 16;
 
 static SDL_Window*   g_pWindow = NULL;
 static SDL_Renderer* g_pRenderer = NULL;
@@ -18,6 +22,12 @@ static int    g_WindowHeight = g_DefaultWindowHeight;
 static int    g_WindowArea   = g_DefaultWindowWidth * g_DefaultWindowHeight;
 static u32*   g_ColorBuffer  = NULL;
 static float* g_ZBuffer      = NULL;
+static u32*   g_IdBuffer     = NULL;   // the visibility buffer: an id of the triangle visible in each pixel
+
+static float*   g_HiZBuffer     = NULL;   // max depth of each block of the z-buffer
+static uint8_t* g_HiZDirty      = NULL;   // the block was written after its max depth had been computed
+static int      g_NumHiZBlocksX = 0;
+static int      g_NumHiZBlocksY = 0;
 
 
 // ==================================================================
@@ -87,6 +97,15 @@ bool InitializeWindow(void)
     // ... and the z-buffer
     g_ZBuffer = (float*)malloc(sizeof(float) * g_WindowWidth * g_WindowHeight);
 
+    // ... and the buffer of triangle ids
+    g_IdBuffer = (u32*)malloc(sizeof(u32) * g_WindowWidth * g_WindowHeight);
+
+    // ... and the Hi-Z (blocks on the right and bottom sides can be smaller)
+    g_NumHiZBlocksX = (g_WindowWidth  + HIZ_BLOCK_SIZE - 1) >> HIZ_BLOCK_SHIFT;
+    g_NumHiZBlocksY = (g_WindowHeight + HIZ_BLOCK_SIZE - 1) >> HIZ_BLOCK_SHIFT;
+    g_HiZBuffer = (float*)malloc(sizeof(float) * g_NumHiZBlocksX * g_NumHiZBlocksY);
+    g_HiZDirty  = (uint8_t*)malloc(sizeof(uint8_t) * g_NumHiZBlocksX * g_NumHiZBlocksY);
+
     ClearZBuffer();
 
     // creating a SDL texture that is used to display the color buffer
@@ -119,6 +138,34 @@ bool IsCullBackface(void) { return g_CullMethod == CULL_BACK; }
 
 ///////////////////////////////////////////////////////////
 
+void SetRenderFlag(const int flag, const bool isEnabled)
+{
+    if (isEnabled)
+        g_RenderFlags |= flag;
+    else
+        g_RenderFlags &= ~flag;
+}
+
+bool IsRenderFlag(const int flag) { return (g_RenderFlags & flag) != 0; }
+
+///////////////////////////////////////////////////////////
+
+void SetSubdivSpanLength(const int numPixels)
+{
+    // the SIMD kernels need the length to be a multiple of the vector width
+    if ((numPixels != 8) && (numPixels != 16))
+    {
+        fprintf(stderr, "Invalid length of subdivided spans: %d (must be 8 or 16).\n", numPixels);
+        return;
+    }
+
+    g_SubdivSpanLength = numPixels;
+}
+
+int GetSubdivSpanLength(void) { return g_SubdivSpanLength; }
+
+///////////////////////////////////////////////////////////
+
 bool ShouldRenderFilledTriangles(void)
 {
     return 
@@ -157,11 +204,9 @@ bool ShouldRenderWireVertices(void)
 
 void DrawPixel(int x, int y, Color color) 
 {
-    // if we have wrong input args we just do nothing
-    if ((x < 0) || (x >= g_WindowWidth) || (y < 0) || (y >= g_WindowHeight))
-        return;
-
-    // set a pixel color at position (x,y) on the screen
+    // set a pixel color at position (x,y) on the screen;
+    // NOTE: there is no bounds check: triangles are scissored to the screen
+    //       during setup, and lines/rects are clipped before drawing
     g_ColorBuffer[y * g_WindowWidth + x] = color;
 }
 
@@ -169,12 +214,71 @@ void DrawPixel(int x, int y, Color color)
 
 void DrawPixelByIdx(const int pixelIdx, Color color)
 {
-    // set a color for a particular pixel by input index
+    // set a color for a particular pixel by input index (which is on the screen)
+    g_ColorBuffer[pixelIdx] = color;
+}
 
-    if (pixelIdx < 0 || (pixelIdx >= g_WindowArea))
-        return;
+///////////////////////////////////////////////////////////
 
-    g_ColorBuffer[pixelIdx] = color;
+static bool ClipLineToScreen(int* x0, int* y0, int* x1, int* y1)
+{
+    // clip the line segment to the screen rectangle (Liang-Barsky);
+    // return false if the line is completely off the screen;
+    // a line which is on the screen keeps its end points as is
+    const double dx = (double)(*x1 - *x0);
+    const double dy = (double)(*y1 - *y0);
+
+    // p[i] * t <= q[i] for the left, right, top and bottom edges of the screen
+    const double p[4] = { -dx, dx, -dy, dy };
+    const double q[4] = 
+    { 
+        *x0, 
+        (g_WindowWidth - 1) - *x0, 
+        *y0, 
+        (g_WindowHeight - 1) - *y0 
+    };
+
+    double t0 = 0.0;
+    double t1 = 1.0;
+
+    for (int i = 0; i < 4; ++i)
+    {
+        if (p[i] == 0.0)
+        {
+            // the line is parallel to the edge and outside of it
+            if (q[i] < 0.0)
+                return false;
+
+            continue;
+        }
+
+        const double t = q[i] / p[i];
+
+        if (p[i] < 0.0)
+            t0 = (t > t0) ? t : t0;   // entering the screen
+        else
+            t1 = (t < t1) ? t : t1;   // leaving the screen
+
+        if (t0 > t1)
+            return false;
+    }
+
+    const int startX = *x0;
+    const int startY = *y0;
+
+    // clamp the new end points as well, so rounding can't move them off the screen
+    if (t1 < 1.0)
+    {
+        *x1 = CLAMP((int)lround(startX + t1 * dx), 0, g_WindowWidth - 1);
+        *y1 = CLAMP((int)lround(startY + t1 * dy), 0, g_WindowHeight - 1);
+    }
+    if (t0 > 0.0)
+    {
+        *x0 = CLAMP((int)lround(startX + t0 * dx), 0, g_WindowWidth - 1);
+        *y0 = CLAMP((int)lround(startY + t0 * dy), 0, g_WindowHeight - 1);
+    }
+
+    return true;
 }
 
 ///////////////////////////////////////////////////////////
@@ -182,6 +286,10 @@ void DrawPixelByIdx(const int pixelIdx, Color color)
 void DrawLine(int x0, int y0, int x1, int y1, Color color)
 {
     // DDA line drawing algorithm
+
+    if (!ClipLineToScreen(&x0, &y0, &x1, &y1))
+        return;
+
     int dx = (x1 - x0);               // delta X
     int dy = (y1 - y0);               // delta Y
 
@@ -209,6 +317,9 @@ void DrawLine2(int x0, int y0, int x1, int y1, Color color)
 {
     // Bresenham line drawing algorithm
 
+    if (!ClipLineToScreen(&x0, &y0, &x1, &y1))
+        return;
+
     int dx = abs(x1 - x0);
     int dy = abs(y1 - y0);
     int sx = (x1 >= x0) ? 1 : -1;
@@ -294,11 +405,37 @@ void DrawGrid(void)
 
 //////////////////////////////////////////////////////////
 
+void DrawGridRect(const Rect* pRect)
+{
+    // draw only those dots of the grid which are inside the input rectangle
+    const int multiple = 10;
+    const u32 gridColor = 0xFF333333;
+
+    const int startX = ((pRect->minX + multiple - 1) / multiple) * multiple;
+    const int startY = ((pRect->minY + multiple - 1) / multiple) * multiple;
+
+    for (int y = startY; y <= pRect->maxY; y += multiple)
+    {
+        for (int x = startX; x <= pRect->maxX; x += multiple)
+        {
+            g_ColorBuffer[(g_WindowWidth * y) + x] = gridColor;
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////
+
 void DrawRect(int x, int y, int width, int height, Color color)
 {
-    for (int posY = y; posY < (y + height); ++posY)
+    // scissor the rectangle to the screen
+    const int minX = MAX(x, 0);
+    const int minY = MAX(y, 0);
+    const int maxX = MIN(x + width,  g_WindowWidth);
+    const int maxY = MIN(y + height, g_WindowHeight);
+
+    for (int posY = minY; posY < maxY; ++posY)
     {
-        for (int posX = x; posX < (x + width); ++posX)
+        for (int posX = minX; posX < maxX; ++posX)
         {
             g_ColorBuffer[g_WindowWidth * posY + posX] = color;
         }
@@ -351,6 +488,85 @@ void ClearZBuffer(void)
     // set the entire z-buffer with a specific value
     for (int i = 0; i < g_WindowArea; ++i)
         g_ZBuffer[i] = 1.0f;
+
+    for (int i = 0; i < g_NumHiZBlocksX * g_NumHiZBlocksY; ++i)
+    {
+        g_HiZBuffer[i] = 1.0f;
+        g_HiZDirty[i]  = 0;
+    }
+}
+
+//////////////////////////////////////////////////////////
+
+void ClearColorBufferRect(const Color color, const Rect* pRect)
+{
+    // set only a rectangle of the color buffer with a specific color value:
+    // fill the first row of the rectangle and then copy it into the other rows
+    const int width = pRect->maxX - pRect->minX + 1;
+    u32* firstRow = g_ColorBuffer + (g_WindowWidth * pRect->minY) + pRect->minX;
+
+    for (int x = 0; x < width; ++x)
+        firstRow[x] = color;
+
+    for (int y = pRect->minY + 1; y <= pRect->maxY; ++y)
+        memcpy(g_ColorBuffer + (g_WindowWidth * y) + pRect->minX, firstRow, sizeof(u32) * width);
+}
+
+//////////////////////////////////////////////////////////
+
+void ClearZBufferRect(const Rect* pRect)
+{
+    // set only a rectangle of the z-buffer with a specific value:
+    // fill the first row of the rectangle and then copy it into the other rows
+    const int width = pRect->maxX - pRect->minX + 1;
+    float* firstRow = g_ZBuffer + (g_WindowWidth * pRect->minY) + pRect->minX;
+
+    for (int x = 0; x < width; ++x)
+        firstRow[x] = 1.0f;
+
+    for (int y = pRect->minY + 1; y <= pRect->maxY; ++y)
+        memcpy(g_ZBuffer + (g_WindowWidth * y) + pRect->minX, firstRow, sizeof(float) * width);
+
+    // reset Hi-Z blocks which are entirely inside the rect (or clipped by
+    // the screen sides), and recompute later the ones which are partially cleared
+    for (int by = pRect->minY >> HIZ_BLOCK_SHIFT; by <= (pRect->maxY >> HIZ_BLOCK_SHIFT); ++by)
+    {
+        for (int bx = pRect->minX >> HIZ_BLOCK_SHIFT; bx <= (pRect->maxX >> HIZ_BLOCK_SHIFT); ++bx)
+        {
+            const int blockIdx = (by * g_NumHiZBlocksX) + bx;
+
+            const bool isInside =
+                ((bx << HIZ_BLOCK_SHIFT) >= pRect->minX) &&
+                ((by << HIZ_BLOCK_SHIFT) >= pRect->minY) &&
+                (MIN(((bx + 1) << HIZ_BLOCK_SHIFT), g_WindowWidth)  - 1 <= pRect->maxX) &&
+                (MIN(((by + 1) << HIZ_BLOCK_SHIFT), g_WindowHeight) - 1 <= pRect->maxY);
+
+            if (isInside)
+            {
+                g_HiZBuffer[blockIdx] = 1.0f;
+                g_HiZDirty[blockIdx]  = 0;
+            }
+            else
+            {
+                g_HiZDirty[blockIdx] = 1;
+            }
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////
+
+void ClearIdBufferRect(const Rect* pRect)
+{
+    // mark a rectangle of the visibility buffer as not covered by triangles
+    const int width = pRect->maxX - pRect->minX + 1;
+    u32* firstRow = g_IdBuffer + (g_WindowWidth * pRect->minY) + pRect->minX;
+
+    for (int x = 0; x < width; ++x)
+        firstRow[x] = ID_BUFFER_EMPTY;
+
+    for (int y = pRect->minY + 1; y <= pRect->maxY; ++y)
+        memcpy(g_IdBuffer + (g_WindowWidth * y) + pRect->minX, firstRow, sizeof(u32) * width);
 }
 
 //////////////////////////////////////////////////////////
@@ -359,6 +575,9 @@ void DestroyWindow()
 {
     free(g_ColorBuffer);
     free(g_ZBuffer);
+    free(g_IdBuffer);
+    free(g_HiZBuffer);
+    free(g_HiZDirty);
 
     SDL_DestroyRenderer(g_pRenderer);
     SDL_DestroyWindow(g_pWindow);
@@ -377,6 +596,12 @@ u32 GetColorBufferByPixelIdx(const int pixelIdx)
 
 //////////////////////////////////////////////////////////
 
+u32*   GetColorBuffer(void) { return g_ColorBuffer; }
+float* GetZBuffer(void)     { return g_ZBuffer; }
+u32*   GetIdBuffer(void)    { return g_IdBuffer; }
+
+//////////////////////////////////////////////////////////
+
 float GetZBufferAt(const int x, const int y)
 {
     if (x < 0 || x >= g_WindowWidth || y < 0 || y >= g_WindowHeight)
@@ -389,9 +614,8 @@ float GetZBufferAt(const int x, const int y)
 
 float GetZBufferByPixelIdx(const int pixelIdx)
 {
-    if (pixelIdx < 0 || (pixelIdx >= g_WindowArea))
-        return 1.0f;
-
+    // NOTE: the rasterizer scissors triangles to the screen,
+    //       so the pixel is always on the screen
     return g_ZBuffer[pixelIdx];
 }
 
@@ -409,11 +633,82 @@ void SetZBufferAt(const int x, const int y, const float value)
 
 void SetZBufferByPixelIdx(const int pixelIdx, const float value)
 {
-    if (pixelIdx < 0 || (pixelIdx >= g_WindowArea))
-        return;
-
     g_ZBuffer[pixelIdx] = value;
 }
 
 //////////////////////////////////////////////////////////
 
+static float ComputeHiZBlockMaxDepth(const int blockX, const int blockY)
+{
+    // find the max depth of the block using the z-buffer
+    const int minX = blockX << HIZ_BLOCK_SHIFT;
+    const int minY = blockY << HIZ_BLOCK_SHIFT;
+    const int maxX = MIN(minX + HIZ_BLOCK_SIZE, g_WindowWidth)  - 1;
+    const int maxY = MIN(minY + HIZ_BLOCK_SIZE, g_WindowHeight) - 1;
+
+#if SIMD_ENABLED
+    // a whole block: its rows are multiples of the SIMD width
+    if (maxX - minX + 1 == HIZ_BLOCK_SIZE)
+    {
+        SimdFloat maxDepths = SimdSetF(0.0f);
+
+        for (int y = minY; y <= maxY; ++y)
+        {
+            const float* row = g_ZBuffer + (g_WindowWidth * y) + minX;
+
+            for (int x = 0; x < HIZ_BLOCK_SIZE; x += SIMD_WIDTH)
+                maxDepths = SimdMaxF(maxDepths, SimdLoadF(row + x));
+        }
+
+        return SimdReduceMaxF(maxDepths);
+    }
+#endif
+
+    float maxDepth = 0.0f;
+
+    for (int y = minY; y <= maxY; ++y)
+    {
+        const float* row = g_ZBuffer + (g_WindowWidth * y);
+
+        for (int x = minX; x <= maxX; ++x)
+            maxDepth = (row[x] > maxDepth) ? row[x] : maxDepth;
+    }
+
+    return maxDepth;
+}
+
+//////////////////////////////////////////////////////////
+
+bool IsHiZBlockHidden(const int blockX, const int blockY, const float minDepth)
+{
+    // the block is hidden if the nearest depth of some geometry within it
+    // isn't closer than the farthest depth of the block; the stored max depth
+    // is conservative so test it first, and if it isn't enough then
+    // recompute the max depth of a block which was written since the last time
+    const int blockIdx = (blockY * g_NumHiZBlocksX) + blockX;
+
+    if (minDepth >= g_HiZBuffer[blockIdx])
+        return true;
+
+    if (!g_HiZDirty[blockIdx])
+        return false;
+
+    g_HiZBuffer[blockIdx] = ComputeHiZBlockMaxDepth(blockX, blockY);
+    g_HiZDirty[blockIdx]  = 0;
+
+    return (minDepth >= g_HiZBuffer[blockIdx]);
+}
+
+//////////////////////////////////////////////////////////
+
+void MarkHiZBlocksDirty(const int y, const int xStart, const int xEnd)
+{
+    // the pixels [xStart, xEnd] of the row y could be written
+    const int rowIdx = (y >> HIZ_BLOCK_SHIFT) * g_NumHiZBlocksX;
+
+    for (int bx = xStart >> HIZ_BLOCK_SHIFT; bx <= (xEnd >> HIZ_BLOCK_SHIFT); ++bx)
+        g_HiZDirty[rowIdx + bx] = 1;
+}
+
+//////////////////////////////////////////////////////////
+
@@ -9,12 +9,27 @@
 #define FPS 500
 #define FRAME_TARGET_TIME (1000 / FPS)
 
+// the hierarchical z-buffer (Hi-Z) keeps the max depth of each 8x8 block
+#define HIZ_BLOCK_SHIFT 3
+#define HIZ_BLOCK_SIZE  (1 << HIZ_BLOCK_SHIFT)
+#define HIZ_BLOCK_MASK  (HIZ_BLOCK_SIZE - 1)
+
+// an id of the visibility buffer for pixels which aren't covered by any triangle
+#define ID_BUFFER_EMPTY 0xFFFFFFFF
+
 // ============================
 // typedefs
 // ============================
 typedef uint32_t u32;
 typedef uint32_t Color;
 
+// screen rectangle in pixels (max bounds are inclusive)
+typedef struct
+{
+    int minX, minY;
+    int maxX, maxY;
+} Rect;
+
 enum CullMethod
 {
     CULL_NONE,              // disable backface-culling
@@ -31,6 +46,18 @@ enum RenderMethod
     RENDER_TEXTURED_WIRE,   // render textured triangle with wireframe on top
 };
 
+// flags which can be combined with the render method
+enum RenderFlag
+{
+    RENDER_FLAG_SIMD = (1 << 0),    // use SIMD span kernels (if compiled with SSE2/AVX2)
+    RENDER_FLAG_SUBDIV_SPANS = (1 << 1),  // do the perspective divide only every N pixels of a span
+    RENDER_FLAG_HIZ = (1 << 2),     // reject hidden blocks of pixels with the Hi-Z before rasterizing them
+    RENDER_FLAG_PAINTER = (1 << 3), // draw triangles from back to front without the z-buffer (painter's algorithm)
+    RENDER_FLAG_VISBUFFER = (1 << 4), // rasterize depth and triangle ids first, then texture each pixel once
+    RENDER_FLAG_GUARD_BAND = (1 << 5),  // don't clip triangles against the side planes within the guard band
+    RENDER_FLAG_OCCLUSION_CULL = (1 << 6),  // skip instances which are hidden behind the occluder instances
+};
+
 // =============================
 // functions prototypes
 // =============================
@@ -44,6 +71,10 @@ bool IsCullBackface(void);
 
 void SetRenderMethod(const int method);
 void SetCullMethod(const int method);
+void SetRenderFlag(const int flag, const bool isEnabled);
+bool IsRenderFlag(const int flag);
+void SetSubdivSpanLength(const int numPixels);  // N for RENDER_FLAG_SUBDIV_SPANS: 8 or 16
+int  GetSubdivSpanLength(void);
 
 bool ShouldRenderFilledTriangles(void);
 bool ShouldRenderTexturedTriangles(void);
@@ -56,20 +87,35 @@ void DrawLine      (int x0, int y0, int x1, int y1, Color color);
 void DrawLine2     (int x0, int y0, int x1, int y1, Color color);
 void DrawTriangle  (int x0, int y0, int x1, int y1, int x2, int y2, Color color);
 void DrawGrid      (void);
+void DrawGridRect  (const Rect* pRect);
 void DrawRect      (int x, int y, int width, int height, Color color);
 void DrawCircle    (int x, int y, int radius, Color color);
 
 void RenderColorBuffer(void);
 void ClearColorBuffer(Color color);
 void ClearZBuffer(void);
+void ClearColorBufferRect(const Color color, const Rect* pRect);
+void ClearZBufferRect(const Rect* pRect);
+void ClearIdBufferRect(const Rect* pRect);
 void DestroyWindow(void);
 
 u32 GetColorBufferByPixelIdx(const int pixelIdx);
 
+// raw buffers access for the rasterizer kernels (no bounds checks)
+u32*   GetColorBuffer(void);
+float* GetZBuffer(void);
+u32*   GetIdBuffer(void);       // ids of the visible triangles (the visibility buffer mode)
+
 // z-buffer setters/getters
 float GetZBufferAt(const int x, const int y);
 float GetZBufferByPixelIdx(const int pixelIdx);
 void SetZBufferAt(const int x, const int y, const float value);
 void SetZBufferByPixelIdx(const int pixelIdx, const float value);
 
+// Hi-Z: the max depth of a block is conservative (it is never less than
+// the actual max depth of the block); blocks which were written are only
+// marked and their max depth is recomputed when it is needed
+bool IsHiZBlockHidden(const int blockX, const int blockY, const float minDepth);
+void MarkHiZBlocksDirty(const int y, const int xStart, const int xEnd);
+
 #endif
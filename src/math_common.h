@@ -20,5 +20,11 @@ extern float DEG_TO_RAD(const float degrees);
 
 float Lerp(const float a, const float b, const float t);
 
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#define MIN3(a, b, c) MIN(MIN((a), (b)), (c))
+#define MAX3(a, b, c) MAX(MAX((a), (b)), (c))
+#define CLAMP(v, lo, hi) MIN(MAX((v), (lo)), (hi))
+
 #endif
 
@@ -3,7 +3,9 @@
 // Description:  implementation of all the matrix functions
 // ==================================================================
 #include "matrix.h"
+#include "simd.h"
 #include <assert.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <string.h>    // for using memcpy
 #include <math.h>      // for using trigonometry functions
@@ -33,29 +35,58 @@ void MatrixInitWorld(
     const Vec3* scale,
     const Vec3* rotation,
     const Vec3* translation,
-    Matrix* outWorld)
+    Matrix* outWorld,
+    Matrix* outWorldInvTranspose)
 {
-    Matrix scaleMat;
-    Matrix rotationMatZ;
-    Matrix rotationMatY;
-    Matrix rotationMatX;
-    Matrix translationMat;
-
-    MatrixInitIdentity(outWorld);
-   
-    // create transformation matrices
-    MatrixScaling(scale->x, scale->y, scale->z, &scaleMat);
-    MatrixRotationX(rotation->x, &rotationMatZ);
-    MatrixRotationY(rotation->y, &rotationMatY);
-    MatrixRotationZ(rotation->z, &rotationMatX);
-    MatrixTranslation(translation->x, translation->y, translation->z, &translationMat);  
-
-    // compute world matrix based on transformation matrices
-    *outWorld = MatrixMulMatrix(&scaleMat, outWorld);
-    *outWorld = MatrixMulMatrix(&rotationMatZ, outWorld);
-    *outWorld = MatrixMulMatrix(&rotationMatY, outWorld);
-    *outWorld = MatrixMulMatrix(&rotationMatX, outWorld);
-    *outWorld = MatrixMulMatrix(&translationMat, outWorld);
+    // build the world matrix  W = T * Rz * Ry * Rx * S  in closed form
+    // (the same as multiplying the matrices from MatrixScaling, MatrixRotationX/Y/Z
+    // and MatrixTranslation, but without building and multiplying them);
+    // 
+    // if outWorldInvTranspose != NULL we also return the inverse-transpose
+    // of W (for transforming normals): R is orthonormal so (R*S)^-T == R * S^-1;
+    // NOTE: the scale must not be zero in this case
+    assert((scale != NULL) & (rotation != NULL) & (translation != NULL) & (outWorld != NULL));
+
+    const float cx = cosf(rotation->x), sx = sinf(rotation->x);
+    const float cy = cosf(rotation->y), sy = sinf(rotation->y);
+    const float cz = cosf(rotation->z), sz = sinf(rotation->z);
+
+    // R = Rz * Ry * Rx
+    const float r00 = cz * cy;
+    const float r01 = cz * sy * sx - sz * cx;
+    const float r02 = cz * sy * cx + sz * sx;
+
+    const float r10 = sz * cy;
+    const float r11 = sz * sy * sx + cz * cx;
+    const float r12 = sz * sy * cx - cz * sx;
+
+    const float r20 = -sy;
+    const float r21 = cy * sx;
+    const float r22 = cy * cx;
+
+    // columns of R are scaled by S, and T is the last column
+    *outWorld = (Matrix)
+    {
+        r00 * scale->x, r01 * scale->y, r02 * scale->z, translation->x,
+        r10 * scale->x, r11 * scale->y, r12 * scale->z, translation->y,
+        r20 * scale->x, r21 * scale->y, r22 * scale->z, translation->z,
+                     0,              0,              0,              1
+    };
+
+    if (outWorldInvTranspose)
+    {
+        const float invSx = 1.0f / scale->x;
+        const float invSy = 1.0f / scale->y;
+        const float invSz = 1.0f / scale->z;
+
+        *outWorldInvTranspose = (Matrix)
+        {
+            r00 * invSx, r01 * invSy, r02 * invSz, 0,
+            r10 * invSx, r11 * invSy, r12 * invSz, 0,
+            r20 * invSx, r21 * invSy, r22 * invSz, 0,
+                      0,           0,           0, 1
+        };
+    }
 }
 
 // ==================================================================
@@ -188,6 +219,116 @@ void MatrixMulVec4(const Matrix* m, const Vec4 v, Vec4* outVec)
 
 ///////////////////////////////////////////////////////////
 
+static void TransformPoints(
+    const Matrix* m,
+    const PointStreams* in,
+    const PointStreams* out,
+    const int count,
+    const bool isProject)
+{
+    // transform points of the input SoA streams with the matrix m
+    // and store them into the output streams; if isProject is set
+    // then x, y, z are divided by w (like MatrixMulVec4Project does);
+    // 
+    // NOTE: the arithmetic order is the same as in MatrixMulVec4 so
+    //       the SIMD and scalar results are identical
+    assert((m != NULL) & (in != NULL) & (out != NULL));
+    assert((out->w != NULL) | !isProject);
+
+    const float* inX = in->x;
+    const float* inY = in->y;
+    const float* inZ = in->z;
+    const float* inW = in->w;
+
+    int i = 0;
+
+#if SIMD_ENABLED
+    const SimdFloat m00 = SimdSetF(m->m00), m01 = SimdSetF(m->m01), m02 = SimdSetF(m->m02), m03 = SimdSetF(m->m03);
+    const SimdFloat m10 = SimdSetF(m->m10), m11 = SimdSetF(m->m11), m12 = SimdSetF(m->m12), m13 = SimdSetF(m->m13);
+    const SimdFloat m20 = SimdSetF(m->m20), m21 = SimdSetF(m->m21), m22 = SimdSetF(m->m22), m23 = SimdSetF(m->m23);
+    const SimdFloat m30 = SimdSetF(m->m30), m31 = SimdSetF(m->m31), m32 = SimdSetF(m->m32), m33 = SimdSetF(m->m33);
+    const SimdFloat one  = SimdSetF(1.0f);
+    const SimdFloat zero = SimdSetF(0.0f);
+
+    for (; i + SIMD_WIDTH <= count; i += SIMD_WIDTH)
+    {
+        const SimdFloat x = SimdLoadF(inX + i);
+        const SimdFloat y = SimdLoadF(inY + i);
+        const SimdFloat z = SimdLoadF(inZ + i);
+        const SimdFloat w = (inW) ? SimdLoadF(inW + i) : one;
+
+        SimdFloat outX = SimdAddF(SimdAddF(SimdAddF(SimdMulF(m00, x), SimdMulF(m01, y)), SimdMulF(m02, z)), SimdMulF(m03, w));
+        SimdFloat outY = SimdAddF(SimdAddF(SimdAddF(SimdMulF(m10, x), SimdMulF(m11, y)), SimdMulF(m12, z)), SimdMulF(m13, w));
+        SimdFloat outZ = SimdAddF(SimdAddF(SimdAddF(SimdMulF(m20, x), SimdMulF(m21, y)), SimdMulF(m22, z)), SimdMulF(m23, w));
+
+        if (isProject | (out->w != NULL))
+        {
+            const SimdFloat outW = SimdAddF(SimdAddF(SimdAddF(SimdMulF(m30, x), SimdMulF(m31, y)), SimdMulF(m32, z)), SimdMulF(m33, w));
+
+            if (isProject)
+            {
+                // lanes with w == 0 are left as is
+                const SimdInt   isZeroW = SimdEqualF(outW, zero);
+                const SimdFloat invW    = SimdSelectF(isZeroW, one, SimdDivF(one, outW));
+
+                outX = SimdMulF(outX, invW);
+                outY = SimdMulF(outY, invW);
+                outZ = SimdMulF(outZ, invW);
+            }
+
+            SimdStoreF(out->w + i, outW);
+        }
+
+        SimdStoreF(out->x + i, outX);
+        SimdStoreF(out->y + i, outY);
+        SimdStoreF(out->z + i, outZ);
+    }
+#endif
+
+    // transform the rest of the points one by one
+    for (; i < count; ++i)
+    {
+        const Vec4 v = { inX[i], inY[i], inZ[i], (inW) ? inW[i] : 1.0f };
+        Vec4 outVec;
+
+        if (isProject)
+            MatrixMulVec4Project(m, v, &outVec);
+        else
+            MatrixMulVec4(m, v, &outVec);
+
+        out->x[i] = outVec.x;
+        out->y[i] = outVec.y;
+        out->z[i] = outVec.z;
+
+        if (out->w)
+            out->w[i] = outVec.w;
+    }
+}
+
+///////////////////////////////////////////////////////////
+
+void MatrixTransformPoints(
+    const Matrix* m,
+    const PointStreams* in,
+    const PointStreams* out,
+    const int count)
+{
+    TransformPoints(m, in, out, count, false);
+}
+
+///////////////////////////////////////////////////////////
+
+void MatrixTransformPointsProject(
+    const Matrix* m,
+    const PointStreams* in,
+    const PointStreams* out,
+    const int count)
+{
+    TransformPoints(m, in, out, count, true);
+}
+
+///////////////////////////////////////////////////////////
+
 Matrix MatrixMulMatrix(const Matrix* m1, const Matrix* m2)
 {
     // multiply input matrix m1 by m2 and 
@@ -280,6 +421,29 @@ void MatrixMulVec4Project(
 
 ///////////////////////////////////////////////////////////
 
+void MatrixViewport(
+    const float halfWidth,
+    const float halfHeight,
+    Matrix* outMat)
+{
+    // return a viewport matrix in outMat; it maps NDC into screen space
+    // (scaling, flipping Y and moving the origin to the middle of the screen)
+    // but works on homogeneous coords so it can be multiplied with the 
+    // projection matrix and applied before the perspective divide:
+    //
+    //   (hw*x + hw*w) / w  ==  hw*(x/w) + hw
+    //   (hh*w - hh*y) / w  == -hh*(y/w) + hh
+    *outMat = (Matrix)
+    {
+        halfWidth,           0, 0, halfWidth,
+                0, -halfHeight, 0, halfHeight,
+                0,           0, 1, 0,
+                0,           0, 0, 1
+    };
+}
+
+///////////////////////////////////////////////////////////
+
 void MatrixView(
     const Vec3 eye, 
     const Vec3 target, 
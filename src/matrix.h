@@ -30,7 +30,12 @@ typedef struct
 extern Matrix gMatrixIdentity;
 
 void MatrixInitIdentity(Matrix* m);
-void MatrixInitWorld(const Vec3* scale, const Vec3* rotation, const Vec3* translation, Matrix* world);
+void MatrixInitWorld(
+    const Vec3* scale, 
+    const Vec3* rotation, 
+    const Vec3* translation, 
+    Matrix* world,
+    Matrix* worldInvTranspose);      // optional (can be NULL)
 
 void MatrixScaling(const float sx, const float sy, const float sz, Matrix* outMat);
 void MatrixTranslation(const float tx, const float ty, const float tz, Matrix* outMat);
@@ -55,6 +60,25 @@ void MatrixMulVec4Project(
     const Vec4 origVec,
     Vec4* projectedVec);
 
+// transform a batch of points given as SoA streams (4 or 8 points at once with SIMD);
+// the input w stream may be NULL (w == 1), and the output w stream may be NULL
+// for affine matrices (the output w isn't stored); input and output may be the same
+void MatrixTransformPoints(
+    const Matrix* m,
+    const PointStreams* in,
+    const PointStreams* out,
+    const int count);
+
+// the same as above, but also performs the perspective divide
+// (so the output w stream is required)
+void MatrixTransformPointsProject(
+    const Matrix* m,
+    const PointStreams* in,
+    const PointStreams* out,
+    const int count);
+
+void MatrixViewport(const float halfWidth, const float halfHeight, Matrix* outMat);
+
 void MatrixView(const Vec3 eye, const Vec3 target, const Vec3 up, Matrix* pOutMatrix);
 
 #endif
@@ -2,36 +2,48 @@
 #include "array.h"
 #include "console_color.h"
 #include "obj_loader.h"
+#include "math_common.h"
+#include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
 #define BUFFER_SIZE 64
 
-#define MAX_NUM_MESHES 10
-static Mesh s_Meshes[MAX_NUM_MESHES];
-static int s_NumMeshes = 0;
+// dynamic arrs (see array.h) of the loaded meshes and of their placements
+static Mesh*         s_Meshes = NULL;
+static MeshInstance* s_MeshInstances = NULL;
+static int*          s_MovedInstances = NULL;   // idxs of the instances which were moved
 
 ///////////////////////////////////////////////////////////
 
 void InitEmptyMesh(Mesh* pMesh)
 {
-    memset(pMesh->name, 0, 32);
+    memset(pMesh->name, 0, sizeof(pMesh->name));
+    memset(pMesh->objPath, 0, sizeof(pMesh->objPath));
+    memset(pMesh->texturePath, 0, sizeof(pMesh->texturePath));
     pMesh->vertices    = NULL;
+    pMesh->positions   = (PointStreams){ NULL, NULL, NULL, NULL };
     pMesh->texCoords   = NULL;
     pMesh->normals     = NULL;
     pMesh->faces       = NULL;
+    pMesh->facePlanes  = NULL;
     pMesh->pTexture    = NULL;
-    pMesh->scale       = (Vec3){ 1,1,1 };
-    pMesh->rotation    = (Vec3){ 0,0,0 };
-    pMesh->translation = (Vec3){ 0,0,0 };
+    pMesh->isTextureOpaque = false;
+    pMesh->aabbMin     = (Vec3){ 0,0,0 };
+    pMesh->aabbMax     = (Vec3){ 0,0,0 };
+    pMesh->sphereCenter = (Vec3){ 0,0,0 };
+    pMesh->sphereRadius = 0;
+    pMesh->numFaces    = 0;
+    pMesh->numVertices = 0;
 }
 
 ///////////////////////////////////////////////////////////
 
 Mesh* GetMeshPtrByIdx(const int meshIdx)
 {
-    if (meshIdx < 0 || meshIdx >= s_NumMeshes)
+    if (meshIdx < 0 || meshIdx >= ArrayLength(s_Meshes))
         return NULL;
 
     return &(s_Meshes[meshIdx]);
@@ -41,39 +53,395 @@ Mesh* GetMeshPtrByIdx(const int meshIdx)
 
 int GetNumMeshes(void)
 {
-    return s_NumMeshes;
+    return ArrayLength(s_Meshes);
 }
 
 ///////////////////////////////////////////////////////////
 
-void LoadMesh(
+MeshInstance* GetMeshInstanceByIdx(const int instanceIdx)
+{
+    if (instanceIdx < 0 || instanceIdx >= ArrayLength(s_MeshInstances))
+        return NULL;
+
+    return &(s_MeshInstances[instanceIdx]);
+}
+
+///////////////////////////////////////////////////////////
+
+int GetNumMeshInstances(void)
+{
+    return ArrayLength(s_MeshInstances);
+}
+
+///////////////////////////////////////////////////////////
+
+int LoadMesh(
     const char* fileDataPath, 
     const char* texturePath,
     const Vec3 translation,
     const Vec3 rotation,
     const Vec3 scale)
 {
+    const int meshIdx = LoadMeshResources(fileDataPath, texturePath);
+
+    if (meshIdx == -1)
+        return -1;
+
+    return AddMeshInstance(meshIdx, translation, rotation, scale);
+}
+
+///////////////////////////////////////////////////////////
+
+int LoadMeshResources(const char* fileDataPath, const char* texturePath)
+{
+    // load geometry and texture of the mesh, or just return an idx of
+    // the mesh if it's already loaded from the same files
     assert((fileDataPath != NULL) && (texturePath != NULL) && "invalid input args");
 
-    Mesh* pMesh = &(s_Meshes[s_NumMeshes]);
+    if ((strlen(fileDataPath) >= MESH_PATH_LENGTH) || (strlen(texturePath) >= MESH_PATH_LENGTH))
+    {
+        printf("\nERROR: too long path of the mesh files: %s, %s\n", fileDataPath, texturePath);
+        return -1;
+    }
+
+    for (int i = 0; i < ArrayLength(s_Meshes); ++i)
+    {
+        if ((strcmp(s_Meshes[i].objPath, fileDataPath) == 0) && 
+            (strcmp(s_Meshes[i].texturePath, texturePath) == 0))
+            return i;
+    }
+
+    Mesh mesh;
+    InitEmptyMesh(&mesh);
 
     // load mesh data from the file
-    int result = LoadObjFileData(pMesh, fileDataPath);
+    int result = LoadObjFileData(&mesh, fileDataPath);
     if (result == -1)
     {
         printf("\nERROR: can't read in .obj file data: %s\n", fileDataPath);
-        return;
+        return -1;
     }
 
     // load mesh texture
-    LoadPngTextureData(&(pMesh->pTexture), texturePath);
+    LoadPngTextureData(&(mesh.pTexture), texturePath);
+    mesh.isTextureOpaque = IsTextureOpaque(mesh.pTexture);
+
+    strcpy(mesh.objPath, fileDataPath);
+    strcpy(mesh.texturePath, texturePath);
+
+    ArrayPush(s_Meshes, mesh);
+
+    return ArrayLength(s_Meshes) - 1;
+}
+
+///////////////////////////////////////////////////////////
+
+int AddMeshInstance(
+    const int meshIdx,
+    const Vec3 translation,
+    const Vec3 rotation,
+    const Vec3 scale)
+{
+    // place the mesh in the world: only the transformation is stored
+    assert((meshIdx >= 0) && (meshIdx < ArrayLength(s_Meshes)) && "invalid mesh idx");
+
+    MeshInstance instance;
+    instance.meshIdx = meshIdx;
+    instance.isMoved = false;
+    instance.isOccluder = false;
+
+    ArrayPush(s_MeshInstances, instance);
 
     // initialize scale, translation, and rotation
-    pMesh->scale = scale;
-    pMesh->translation = translation;
-    pMesh->rotation = rotation;
+    MeshInstance* pInstance = s_MeshInstances + ArrayLength(s_MeshInstances) - 1;
+    SetInstanceScale(pInstance, scale);
+    SetInstanceTranslation(pInstance, translation);
+    SetInstanceRotation(pInstance, rotation);
+
+    return ArrayLength(s_MeshInstances) - 1;
+}
+
+///////////////////////////////////////////////////////////
+
+void FreeMeshes(void)
+{
+    if (s_Meshes)
+        ArrayFree((void**)&s_Meshes);
+
+    if (s_MeshInstances)
+        ArrayFree((void**)&s_MeshInstances);
+
+    if (s_MovedInstances)
+        ArrayFree((void**)&s_MovedInstances);
+}
+
+///////////////////////////////////////////////////////////
+
+static void MarkInstanceMoved(MeshInstance* pInstance)
+{
+    // the cached world matrices must be rebuilt, and the instance is
+    // added into the list of moved instances (once) so the bounds of
+    // the moved instances can be updated without visiting all of them
+    pInstance->isWorldDirty = true;
+
+    if (pInstance->isMoved)
+        return;
+
+    const int instanceIdx = (int)(pInstance - s_MeshInstances);
+    assert((instanceIdx >= 0) && (instanceIdx < ArrayLength(s_MeshInstances)) && "the instance isn't from the arr of instances");
+
+    pInstance->isMoved = true;
+    ArrayPush(s_MovedInstances, instanceIdx);
+}
+
+///////////////////////////////////////////////////////////
+
+void SetInstanceScale(MeshInstance* pInstance, const Vec3 scale)
+{
+    pInstance->scale = scale;
+    MarkInstanceMoved(pInstance);
+}
+
+void SetInstanceRotation(MeshInstance* pInstance, const Vec3 rotation)
+{
+    pInstance->rotation = rotation;
+    MarkInstanceMoved(pInstance);
+}
+
+void SetInstanceTranslation(MeshInstance* pInstance, const Vec3 translation)
+{
+    pInstance->translation = translation;
+    MarkInstanceMoved(pInstance);
+}
+
+///////////////////////////////////////////////////////////
+
+const int* GetMovedInstances(void)
+{
+    return s_MovedInstances;
+}
+
+int GetNumMovedInstances(void)
+{
+    return ArrayLength(s_MovedInstances);
+}
+
+void ClearMovedInstances(void)
+{
+    for (int i = 0; i < ArrayLength(s_MovedInstances); ++i)
+        s_MeshInstances[s_MovedInstances[i]].isMoved = false;
+
+    ArrayClear(s_MovedInstances);
+}
+
+///////////////////////////////////////////////////////////
+
+static void UpdateInstanceWorldMatrices(MeshInstance* pInstance)
+{
+    // rebuild the cached world matrices only if the instance was moved
+    if (!pInstance->isWorldDirty)
+        return;
+
+    MatrixInitWorld(
+        &pInstance->scale,
+        &pInstance->rotation,
+        &pInstance->translation,
+        &pInstance->world,
+        &pInstance->worldInvTranspose);
+
+    pInstance->isWorldDirty = false;
+}
+
+///////////////////////////////////////////////////////////
+
+const Matrix* GetInstanceWorldMatrix(MeshInstance* pInstance)
+{
+    UpdateInstanceWorldMatrices(pInstance);
+    return &pInstance->world;
+}
+
+///////////////////////////////////////////////////////////
+
+const Matrix* GetInstanceWorldInvTransposeMatrix(MeshInstance* pInstance)
+{
+    UpdateInstanceWorldMatrices(pInstance);
+    return &pInstance->worldInvTranspose;
+}
+
+///////////////////////////////////////////////////////////
+
+Vec3 TransformPointToInstanceSpace(MeshInstance* pInstance, const Vec3 worldPoint)
+{
+    // transform a world space point into the object space of the instance;
+    // the linear part of the world matrix inverse is (R*S)^-1 == S^-1 * R^T,
+    // which is just the transposed (cached) inverse-transpose matrix
+    const Matrix* pInvT = GetInstanceWorldInvTransposeMatrix(pInstance);
+    const Vec3 p = Vec3Sub(worldPoint, pInstance->translation);
+
+    return (Vec3)
+    {
+        pInvT->m[0][0] * p.x + pInvT->m[1][0] * p.y + pInvT->m[2][0] * p.z,
+        pInvT->m[0][1] * p.x + pInvT->m[1][1] * p.y + pInvT->m[2][1] * p.z,
+        pInvT->m[0][2] * p.x + pInvT->m[1][2] * p.y + pInvT->m[2][2] * p.z
+    };
+}
+
+///////////////////////////////////////////////////////////
+
+void GetInstanceWorldAabb(MeshInstance* pInstance, Vec3* pOutMin, Vec3* pOutMax)
+{
+    // transform the center of the mesh AABB, and the half extents by the
+    // absolute values of the world matrix (Arvo's method), so we get
+    // the tightest AABB around the transformed box
+    const Mesh* pMesh = s_Meshes + pInstance->meshIdx;
+    const Matrix* pW = GetInstanceWorldMatrix(pInstance);
+
+    const Vec3 c = Vec3Mul(Vec3Add(pMesh->aabbMin, pMesh->aabbMax), 0.5f);
+    const Vec3 e = Vec3Mul(Vec3Sub(pMesh->aabbMax, pMesh->aabbMin), 0.5f);
+
+    const Vec3 center =
+    {
+        pW->m[0][0] * c.x + pW->m[0][1] * c.y + pW->m[0][2] * c.z + pW->m[0][3],
+        pW->m[1][0] * c.x + pW->m[1][1] * c.y + pW->m[1][2] * c.z + pW->m[1][3],
+        pW->m[2][0] * c.x + pW->m[2][1] * c.y + pW->m[2][2] * c.z + pW->m[2][3]
+    };
+
+    const Vec3 extent =
+    {
+        fabsf(pW->m[0][0]) * e.x + fabsf(pW->m[0][1]) * e.y + fabsf(pW->m[0][2]) * e.z,
+        fabsf(pW->m[1][0]) * e.x + fabsf(pW->m[1][1]) * e.y + fabsf(pW->m[1][2]) * e.z,
+        fabsf(pW->m[2][0]) * e.x + fabsf(pW->m[2][1]) * e.y + fabsf(pW->m[2][2]) * e.z
+    };
+
+    *pOutMin = Vec3Sub(center, extent);
+    *pOutMax = Vec3Add(center, extent);
+}
+
+///////////////////////////////////////////////////////////
+
+static void ComputeBoundingVolumes(Mesh* pMesh)
+{
+    // compute object space AABB and bounding sphere of the mesh;
+    // the sphere is centered at the AABB center, and its radius is
+    // the distance to the farthest vertex (tighter than half the diagonal)
+    if (pMesh->numVertices == 0)
+        return;
+
+    Vec3 minP = pMesh->vertices[0];
+    Vec3 maxP = pMesh->vertices[0];
+
+    for (int i = 1; i < pMesh->numVertices; ++i)
+    {
+        const Vec3 v = pMesh->vertices[i];
+
+        minP.x = MIN(minP.x, v.x);
+        minP.y = MIN(minP.y, v.y);
+        minP.z = MIN(minP.z, v.z);
+
+        maxP.x = MAX(maxP.x, v.x);
+        maxP.y = MAX(maxP.y, v.y);
+        maxP.z = MAX(maxP.z, v.z);
+    }
+
+    const Vec3 center = Vec3Mul(Vec3Add(minP, maxP), 0.5f);
+    float maxSqrDist = 0;
+
+    for (int i = 0; i < pMesh->numVertices; ++i)
+    {
+        const Vec3 d = Vec3Sub(pMesh->vertices[i], center);
+        maxSqrDist = MAX(maxSqrDist, Vec3Dot(d, d));
+    }
+
+    pMesh->aabbMin      = minP;
+    pMesh->aabbMax      = maxP;
+    pMesh->sphereCenter = center;
+    pMesh->sphereRadius = sqrtf(maxSqrDist);
+}
+
+///////////////////////////////////////////////////////////
 
-    s_NumMeshes++;
+static int ComputeFacePlanes(Mesh* pMesh)
+{
+    // compute an object space plane of each face once at load time, so the 
+    // backface test is a single dot product with the camera position taken 
+    // into object space; the normal isn't normalized since only the sign matters
+    if (pMesh->numFaces == 0)
+        return 0;
+
+    pMesh->facePlanes = (Vec4*)malloc(sizeof(Vec4) * pMesh->numFaces);
+
+    if (!pMesh->facePlanes)
+        return -1;
+
+    for (int i = 0; i < pMesh->numFaces; ++i)
+    {
+        const Face* pFace = pMesh->faces + i;
+        const Vec3 a = pMesh->vertices[pFace->a];
+        const Vec3 b = pMesh->vertices[pFace->b];
+        const Vec3 c = pMesh->vertices[pFace->c];
+
+        const Vec3 n = Vec3Cross(Vec3Sub(b, a), Vec3Sub(c, a));
+
+        pMesh->facePlanes[i] = (Vec4){ n.x, n.y, n.z, -Vec3Dot(n, a) };
+    }
+
+    return 0;
+}
+
+///////////////////////////////////////////////////////////
+
+static int CopyVerticesPositions(Mesh* pMesh)
+{
+    // make a SoA copy of vertices (all the streams in a single allocation)
+    // so the geometry stages can transform a few vertices at once
+    const int numVertices = pMesh->numVertices;
+    float* positions = (float*)malloc(sizeof(float) * 3 * numVertices);
+
+    if (!positions)
+        return -1;
+
+    pMesh->positions.x = positions;
+    pMesh->positions.y = positions + numVertices;
+    pMesh->positions.z = positions + numVertices * 2;
+    pMesh->positions.w = NULL;
+
+    for (int i = 0; i < numVertices; ++i)
+    {
+        pMesh->positions.x[i] = pMesh->vertices[i].x;
+        pMesh->positions.y[i] = pMesh->vertices[i].y;
+        pMesh->positions.z[i] = pMesh->vertices[i].z;
+    }
+
+    return 0;
+}
+
+///////////////////////////////////////////////////////////
+
+static void FreeMeshGeometry(Mesh* pMesh)
+{
+    // release everything LoadObjFileData allocates for the mesh
+    // (used when the loading fails, so nothing is left allocated)
+    if (pMesh->vertices)
+        ArrayFree((void**)&(pMesh->vertices));
+
+    if (pMesh->texCoords)
+        ArrayFree((void**)&(pMesh->texCoords));
+
+    if (pMesh->normals)
+        ArrayFree((void**)&(pMesh->normals));
+
+    if (pMesh->faces)
+        ArrayFree((void**)&(pMesh->faces));
+
+    // all the SoA streams live in a single allocation
+    free(pMesh->positions.x);
+    pMesh->positions = (PointStreams){ NULL, NULL, NULL, NULL };
+
+    free(pMesh->facePlanes);
+    pMesh->facePlanes = NULL;
+
+    pMesh->numFaces    = 0;
+    pMesh->numVertices = 0;
 }
 
 ///////////////////////////////////////////////////////////
@@ -122,19 +490,40 @@ int LoadObjFileData(Mesh* pMesh, const char* filepath)
         }
     }
 
-    // set and print the number of faces in this mesh
-    pMesh->numFaces = ArrayLength(pMesh->faces);
+    fclose(pFile);
+
+    // set and print the number of faces and vertices in this mesh
+    pMesh->numFaces    = ArrayLength(pMesh->faces);
+    pMesh->numVertices = ArrayLength(pMesh->vertices);
     printf("- the number of loaded faces:%d\n", pMesh->numFaces);
+    printf("- the number of loaded vertices:%d\n", pMesh->numVertices);
+
+    if (pMesh->numVertices == 0)
+    {
+        fprintf(stderr, "there are no vertices in the .obj file: %s\n", filepath);
+        FreeMeshGeometry(pMesh);
+        return -1;
+    }
+
+    // the single cleanup path: a failed load leaves nothing allocated
+    if ((CopyVerticesPositions(pMesh) != 0) || (ComputeFacePlanes(pMesh) != 0))
+    {
+        fprintf(stderr, "can't allocate memory for the mesh geometry: %s\n", filepath);
+        FreeMeshGeometry(pMesh);
+        return -1;
+    }
+
+    ComputeBoundingVolumes(pMesh);
    
     // set a name for the mesh
-    const int nameLength = (strlen(filepath) > 32) ? 32 : strlen(filepath);
+    const int nameLength = MIN(strlen(filepath), sizeof(pMesh->name) - 1);
     strncpy(pMesh->name, filepath, nameLength);
+    pMesh->name[nameLength] = '\0';
 
 
     // release memory from the temp texture coords data buffer
-    ArrayFree((void**)&(pMesh->texCoords));
-
-    fclose(pFile);
+    if (pMesh->texCoords)
+        ArrayFree((void**)&(pMesh->texCoords));
 
 
     printf(".obj asset is successfully loaded: %s\n\n", filepath); 
@@ -1,48 +1,135 @@
 #ifndef MESH_H
 #define MESH_H
 
+#include <stdbool.h>
 #include "vector.h"
+#include "matrix.h"
 #include "triangle.h"
 #include "upng.h"
 
+#define MESH_PATH_LENGTH 128
+
 // ==================================================================
 // define a struct for dynamic size meshes, 
-// with arr of vertices and faces
+// with arr of vertices and faces;
+// 
+// NOTE: it's immutable resources which are loaded once
+//       and shared by all the instances of the mesh
 // ==================================================================
 typedef struct 
 {
     char name[32];
+    char objPath[MESH_PATH_LENGTH];         // the files the mesh is loaded from 
+    char texturePath[MESH_PATH_LENGTH];     // (so an asset is loaded only once)
+
     Vec3* vertices;                 // dynamic arr of vertices
+    PointStreams positions;         // SoA copy of vertices for batch transformation (w == NULL)
     Tex2* texCoords;                 // texture UV coords
     Vec3* normals;                  // normal vectors
                                     
     Face* faces;                    // dynamic arr of faces
+    Vec4* facePlanes;               // object space plane of each face: (normal, d), not normalized
     upng_t* pTexture;                // PNG texture pointer for mesh                                    
+    bool  isTextureOpaque;          // the texture has no transparent texels
+
+    // object space bounding volumes (computed at load time)
+    Vec3  aabbMin;
+    Vec3  aabbMax;
+    Vec3  sphereCenter;             // the center of the AABB
+    float sphereRadius;
+
+    int   numFaces;
+    int   numVertices;
+} Mesh;
+
+// ==================================================================
+// a placement of a mesh in the world: only the transformation
+// and the state, all the geometry is shared with the mesh
+// ==================================================================
+typedef struct
+{
+    int   meshIdx;                  // the mesh which is placed
 
+    // NOTE: change them only with SetInstanceScale/Rotation/Translation 
+    //       so the cached world matrices are rebuilt
     Vec3  scale;
     Vec3  rotation;                 
     Vec3  translation;
-    int   numFaces;
-} Mesh;
+
+    Matrix world;                   // cached world matrix (see GetInstanceWorldMatrix)
+    Matrix worldInvTranspose;       // cached inverse-transpose of the world matrix
+    bool  isWorldDirty;             // scale/rotation/translation were changed
+    bool  isMoved;                  // it's in the list of moved instances (see GetMovedInstances)
+    bool  isOccluder;               // it's rasterized into the occlusion buffer (see occlusion.h)
+} MeshInstance;
 
 
 // ==================================================================
 // functions prototypes
 // ==================================================================
+
+// NOTE: meshes and instances are stored in dynamic arrays, so the pointers 
+//       which are returned by these getters are valid only until the next
+//       mesh or instance is added
 void InitEmptyMesh(Mesh* pMesh);
 
 Mesh* GetMeshPtrByIdx(const int meshIdx);
 int GetNumMeshes(void);
 
-void LoadMesh(
+MeshInstance* GetMeshInstanceByIdx(const int instanceIdx);
+int GetNumMeshInstances(void);
+
+// place a mesh in the world: its files are loaded only if they aren't 
+// loaded yet; return an idx of the new instance (or -1 if there is an error)
+int LoadMesh(
     const char* fileDataPath, 
     const char* texturePath,
     const Vec3 translation,
     const Vec3 rotation,
     const Vec3 scale);
 
+int  LoadMeshResources(const char* fileDataPath, const char* texturePath);
+int  AddMeshInstance(
+    const int meshIdx,
+    const Vec3 translation,
+    const Vec3 rotation,
+    const Vec3 scale);
+
 int  LoadObjFileData(Mesh* pMesh, const char* filepath);
 
+// release the arrays of meshes and instances (the resources 
+// of each mesh must be released before with FreeAssetResources)
+void FreeMeshes(void);
+
+void SetInstanceScale      (MeshInstance* pInstance, const Vec3 scale);
+void SetInstanceRotation   (MeshInstance* pInstance, const Vec3 rotation);
+void SetInstanceTranslation(MeshInstance* pInstance, const Vec3 translation);
+
+const Matrix* GetInstanceWorldMatrix            (MeshInstance* pInstance);
+const Matrix* GetInstanceWorldInvTransposeMatrix(MeshInstance* pInstance);
+
+Vec3 TransformPointToInstanceSpace(MeshInstance* pInstance, const Vec3 worldPoint);
+
+// the world space AABB of the instance (the AABB of its transformed mesh AABB)
+void GetInstanceWorldAabb(MeshInstance* pInstance, Vec3* pOutMin, Vec3* pOutMax);
+
+// idxs of the instances which were moved (or added) since the last ClearMovedInstances
+const int* GetMovedInstances(void);
+int  GetNumMovedInstances(void);
+void ClearMovedInstances(void);
+
+// the camera (in the object space of the mesh) is behind the plane of the face
+static inline bool IsFaceFacingAway(const Vec4 facePlane, const Vec4 cameraPos)
+{
+    const float dist =
+        facePlane.x * cameraPos.x +
+        facePlane.y * cameraPos.y +
+        facePlane.z * cameraPos.z +
+        facePlane.w * cameraPos.w;
+
+    return dist < 0;
+}
+
 void DebugVertices(Vec3* vertices);
 void DebugTexCoords(Vec2* texCoords);
 void DebugNormals(Vec3* normals);
@@ -0,0 +1,522 @@
+// ==================================================================
+// Filename:    occlusion.c
+// Description: implementation of the occluder depth buffer
+//
+//              the buffer keeps 1/w of the nearest occluder of each
+//              pixel (0 if there is no occluder), since 1/w is linear
+//              in screen space and so it's interpolated with additions;
+//              a polygon writes only the pixels which are completely
+//              inside it: the edge functions are shifted inwards by
+//              the half extent of a pixel along their normals, so the
+//              test of the pixel center is the test of its farthest
+//              corner; the coverage of polygons isn't merged, so the
+//              pixels on their shared edges are left empty, but two
+//              coplanar faces which form a convex quad (e.g. a side of
+//              a box) are rasterized as a single polygon, and so is a
+//              face clipped by the near plane
+// ==================================================================
+#include "occlusion.h"
+#include "clipping.h"
+#include "display.h"
+#include "math_common.h"
+#include "simd.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <assert.h>
+
+#define OCCLUSION_BUFFER_SIZE (OCCLUSION_BUFFER_WIDTH * OCCLUSION_BUFFER_HEIGHT)
+
+#if (OCCLUSION_BUFFER_WIDTH % SIMD_WIDTH) != 0
+#error "OCCLUSION_BUFFER_WIDTH must be a multiple of SIMD_WIDTH"
+#endif
+
+// a triangle or a convex quad
+#define OCCLUDER_MAX_EDGES 4
+
+// precomputed data to rasterize an occluder polygon
+typedef struct
+{
+    float a[OCCLUDER_MAX_EDGES];    // edge functions: a*x + b*y + c (all are >= 0 if the whole pixel is inside)
+    float b[OCCLUDER_MAX_EDGES];    // (a triangle has the last one 0 everywhere)
+    float c[OCCLUDER_MAX_EDGES];
+    float dzdx;             // 1/w gradients
+    float dzdy;
+    float z0;               // 1/w at the screen origin
+    float zMargin;          // the max change of 1/w from the center of a pixel to its corner
+} OccluderPolygon;
+
+typedef void (*OccluderRowFunc)(const OccluderPolygon* pPoly, float* row, const int x0, const int x1, const float cy);
+
+static float* s_OcclusionDepth = NULL;     // 1/w of the nearest occluder
+
+// clip space vertices of the current occluder (4 streams in one allocation)
+static float* s_OccluderStreams = NULL;
+static int    s_OccluderCapacity = 0;
+
+
+///////////////////////////////////////////////////////////
+
+void ClearOcclusionBuffer(void)
+{
+    if (!s_OcclusionDepth)
+    {
+        s_OcclusionDepth = (float*)malloc(sizeof(float) * OCCLUSION_BUFFER_SIZE);
+        assert(s_OcclusionDepth && "can't allocate memory for the occlusion buffer");
+    }
+
+    memset(s_OcclusionDepth, 0, sizeof(float) * OCCLUSION_BUFFER_SIZE);
+}
+
+///////////////////////////////////////////////////////////
+
+void FreeOcclusionBuffer(void)
+{
+    free(s_OcclusionDepth);
+    free(s_OccluderStreams);
+
+    s_OcclusionDepth   = NULL;
+    s_OccluderStreams  = NULL;
+    s_OccluderCapacity = 0;
+}
+
+///////////////////////////////////////////////////////////
+
+static inline Vec3 ClipToOcclusionBuffer(const Vec4 v)
+{
+    // map a clip space point (w > 0) into the buffer: (x, y, 1/w)
+    const float recipW = 1.0f / v.w;
+
+    return (Vec3)
+    {
+        (0.5f + 0.5f * v.x * recipW) * OCCLUSION_BUFFER_WIDTH,
+        (0.5f - 0.5f * v.y * recipW) * OCCLUSION_BUFFER_HEIGHT,
+        recipW
+    };
+}
+
+///////////////////////////////////////////////////////////
+
+static void RasterizeOccluderRow(const OccluderPolygon* pPoly, float* row, const int x0, const int x1, const float cy)
+{
+    const float c0 = pPoly->b[0] * cy + pPoly->c[0];
+    const float c1 = pPoly->b[1] * cy + pPoly->c[1];
+    const float c2 = pPoly->b[2] * cy + pPoly->c[2];
+    const float c3 = pPoly->b[3] * cy + pPoly->c[3];
+    const float zRow = pPoly->dzdy * cy + pPoly->z0 - pPoly->zMargin;
+
+    for (int x = x0; x < x1; ++x)
+    {
+        const float cx = (float)x + 0.5f;
+
+        if ((pPoly->a[0] * cx + c0 < 0) | (pPoly->a[1] * cx + c1 < 0) | (pPoly->a[2] * cx + c2 < 0) | (pPoly->a[3] * cx + c3 < 0))
+            continue;
+
+        // the farthest depth of the polygon within the pixel
+        const float z = pPoly->dzdx * cx + zRow;
+        row[x] = MAX(row[x], z);
+    }
+}
+
+///////////////////////////////////////////////////////////
+
+#if SIMD_ENABLED
+static void RasterizeOccluderRowSimd(const OccluderPolygon* pPoly, float* row, const int x0, const int x1, const float cy)
+{
+    // the same as above but for SIMD_WIDTH pixels at once; the row is
+    // processed from x0 aligned down to SIMD_WIDTH (the buffer width is
+    // a multiple of SIMD_WIDTH) and the lanes outside the polygon fail
+    // the edge test, so the result is identical to the scalar kernel
+    const SimdFloat a0 = SimdSetF(pPoly->a[0]);
+    const SimdFloat a1 = SimdSetF(pPoly->a[1]);
+    const SimdFloat a2 = SimdSetF(pPoly->a[2]);
+    const SimdFloat a3 = SimdSetF(pPoly->a[3]);
+    const SimdFloat c0 = SimdSetF(pPoly->b[0] * cy + pPoly->c[0]);
+    const SimdFloat c1 = SimdSetF(pPoly->b[1] * cy + pPoly->c[1]);
+    const SimdFloat c2 = SimdSetF(pPoly->b[2] * cy + pPoly->c[2]);
+    const SimdFloat c3 = SimdSetF(pPoly->b[3] * cy + pPoly->c[3]);
+    const SimdFloat dzdx = SimdSetF(pPoly->dzdx);
+    const SimdFloat zRow = SimdSetF(pPoly->dzdy * cy + pPoly->z0 - pPoly->zMargin);
+    const SimdFloat zero = SimdSetF(0.0f);
+    const SimdFloat laneIdx = SimdLaneIdxF();
+
+    for (int x = x0 - (x0 % SIMD_WIDTH); x < x1; x += SIMD_WIDTH)
+    {
+        const SimdFloat cx = SimdAddF(SimdSetF((float)x + 0.5f), laneIdx);
+
+        const SimdInt isOutside = SimdOrI(
+            SimdOrI(
+                SimdLessF(SimdAddF(SimdMulF(a0, cx), c0), zero),
+                SimdLessF(SimdAddF(SimdMulF(a1, cx), c1), zero)),
+            SimdOrI(
+                SimdLessF(SimdAddF(SimdMulF(a2, cx), c2), zero),
+                SimdLessF(SimdAddF(SimdMulF(a3, cx), c3), zero)));
+
+        if (SimdMoveMask(isOutside) == (1 << SIMD_WIDTH) - 1)
+            continue;
+
+        const SimdFloat z = SimdAddF(SimdMulF(dzdx, cx), zRow);
+        const SimdFloat depth = SimdLoadF(row + x);
+
+        SimdStoreF(row + x, SimdSelectF(isOutside, depth, SimdMaxF(depth, z)));
+    }
+}
+#endif
+
+///////////////////////////////////////////////////////////
+
+static inline float SignedArea2(const Vec3 p0, const Vec3 p1, const Vec3 p2)
+{
+    // twice the signed area of the triangle in the buffer (> 0 if it's
+    // counter-clockwise, y is down)
+    return (p1.x - p0.x) * (p2.y - p0.y) - (p2.x - p0.x) * (p1.y - p0.y);
+}
+
+///////////////////////////////////////////////////////////
+
+static void RasterizeOccluderPolygon(const Vec3* points, const int numPoints, const OccluderRowFunc rasterizeRow)
+{
+    // rasterize a triangle or a convex quad (with the points along its
+    // boundary in either order, the faces which must not be rasterized
+    // from this side are already skipped by the caller)
+    assert((numPoints == 3) || (numPoints == 4));
+
+    Vec3 p[OCCLUDER_MAX_EDGES];
+    memcpy(p, points, sizeof(Vec3) * numPoints);
+
+    // the area of the two halves of the polygon split by the diagonal
+    // from p[0] (the second half is empty for a triangle)
+    float area0 = SignedArea2(p[0], p[1], p[2]);
+    float area1 = (numPoints == 4) ? SignedArea2(p[0], p[2], p[3]) : 0.0f;
+
+    // make the polygon counter-clockwise so the edge functions are positive inside
+    if (area0 + area1 < 0)
+    {
+        for (int i = 1, j = numPoints - 1; i < j; ++i, --j)
+        {
+            const Vec3 tmp = p[i];
+            p[i] = p[j];
+            p[j] = tmp;
+        }
+
+        const float tmp = area0;
+        area0 = (numPoints == 4) ? -area1 : -area0;
+        area1 = (numPoints == 4) ? -tmp : 0.0f;
+    }
+
+    if (numPoints == 4)
+    {
+        // a quad which isn't convex is rasterized as two triangles; the
+        // caller passes a pair of faces with the shared edge p[1], p[3]
+        if ((SignedArea2(p[0], p[1], p[3]) < 0) || (SignedArea2(p[1], p[2], p[3]) < 0) ||
+            (area0 < 0) || (area1 < 0))
+        {
+            const Vec3 tri0[3] = { p[0], p[1], p[3] };
+            const Vec3 tri1[3] = { p[1], p[2], p[3] };
+
+            RasterizeOccluderPolygon(tri0, 3, rasterizeRow);
+            RasterizeOccluderPolygon(tri1, 3, rasterizeRow);
+            return;
+        }
+    }
+
+    if (area0 + area1 < 1e-6f)
+        return;
+
+    float minX = p[0].x, minY = p[0].y;
+    float maxX = p[0].x, maxY = p[0].y;
+
+    for (int i = 1; i < numPoints; ++i)
+    {
+        minX = MIN(minX, p[i].x);
+        minY = MIN(minY, p[i].y);
+        maxX = MAX(maxX, p[i].x);
+        maxY = MAX(maxY, p[i].y);
+    }
+
+    // the pixels which are completely within the bounding box (the bounds are
+    // clamped as floats first since the points can be far out of the buffer)
+    const int x0 = (int)ceilf (MAX(minX, 0.0f));
+    const int y0 = (int)ceilf (MAX(minY, 0.0f));
+    const int x1 = (int)floorf(MIN(maxX, (float)OCCLUSION_BUFFER_WIDTH));
+    const int y1 = (int)floorf(MIN(maxY, (float)OCCLUSION_BUFFER_HEIGHT));
+
+    if ((x0 >= x1) || (y0 >= y1))
+        return;
+
+    OccluderPolygon poly = { 0 };
+
+    for (int i = 0; i < numPoints; ++i)
+    {
+        // the edge from p[i] to p[i + 1]
+        const Vec3 v0 = p[i];
+        const Vec3 v1 = p[(i + 1) % numPoints];
+
+        poly.a[i] = v0.y - v1.y;
+        poly.b[i] = v1.x - v0.x;
+
+        // shifted inwards by the max change of the edge function from the
+        // center of a pixel to its corner
+        poly.c[i] = -(poly.a[i] * v0.x + poly.b[i] * v0.y) - 0.5f * (fabsf(poly.a[i]) + fabsf(poly.b[i]));
+    }
+
+    // 1/w is linear over a planar polygon, so its gradients are taken from
+    // the larger half; the points may be slightly off that plane (or the
+    // quad isn't planar at all), so the plane is moved behind all of them
+    const Vec3 q0 = p[0];
+    const Vec3 q1 = (area0 >= area1) ? p[1] : p[2];
+    const Vec3 q2 = (area0 >= area1) ? p[2] : p[3];
+    const float invArea = 1.0f / MAX(area0, area1);
+
+    poly.dzdx = ((q1.z - q0.z) * (q2.y - q0.y) - (q2.z - q0.z) * (q1.y - q0.y)) * invArea;
+    poly.dzdy = ((q2.z - q0.z) * (q1.x - q0.x) - (q1.z - q0.z) * (q2.x - q0.x)) * invArea;
+    poly.z0   = q0.z - poly.dzdx * q0.x - poly.dzdy * q0.y;
+
+    float offPlane = 0;
+
+    for (int i = 0; i < numPoints; ++i)
+        offPlane = MAX(offPlane, poly.dzdx * p[i].x + poly.dzdy * p[i].y + poly.z0 - p[i].z);
+
+    poly.zMargin = 0.5f * (fabsf(poly.dzdx) + fabsf(poly.dzdy)) + offPlane;
+
+    for (int y = y0; y < y1; ++y)
+        rasterizeRow(&poly, s_OcclusionDepth + y * OCCLUSION_BUFFER_WIDTH, x0, x1, (float)y + 0.5f);
+}
+
+///////////////////////////////////////////////////////////
+
+static bool ReserveOccluderVertices(const int numVertices)
+{
+    if (numVertices <= s_OccluderCapacity)
+        return true;
+
+    const int capacity = MAX(numVertices, s_OccluderCapacity * 2);
+
+    free(s_OccluderStreams);
+    s_OccluderStreams = (float*)malloc(sizeof(float) * 4 * capacity);
+
+    if (!s_OccluderStreams)
+    {
+        fprintf(stderr, "can't allocate memory for %d occluder vertices\n", capacity);
+        s_OccluderCapacity = 0;
+        return false;
+    }
+
+    s_OccluderCapacity = capacity;
+    return true;
+}
+
+///////////////////////////////////////////////////////////
+
+static bool GetQuadWithNextFace(const Mesh* pMesh, const int faceIdx, int quad[4])
+{
+    // the face and the next one form a quad if they share an edge and are
+    // coplanar (a triangulated quad is usually written as two faces in a row);
+    // the vertices go along the boundary with the shared edge quad[1], quad[3]
+    if (faceIdx + 1 >= pMesh->numFaces)
+        return false;
+
+    const Face* pFace = pMesh->faces + faceIdx;
+    const Face* pNext = pFace + 1;
+    const int curr[3] = { pFace->a, pFace->b, pFace->c };
+    const int next[3] = { pNext->a, pNext->b, pNext->c };
+
+    int notShared = -1;
+    int numNotShared = 0;
+
+    for (int i = 0; i < 3; ++i)
+    {
+        if ((curr[i] != next[0]) && (curr[i] != next[1]) && (curr[i] != next[2]))
+        {
+            notShared = i;
+            ++numNotShared;
+        }
+    }
+
+    if (numNotShared != 1)
+        return false;
+
+    const Vec4 n0 = pMesh->facePlanes[faceIdx];
+    const Vec4 n1 = pMesh->facePlanes[faceIdx + 1];
+    const float dot = n0.x * n1.x + n0.y * n1.y + n0.z * n1.z;
+    const float len0 = n0.x * n0.x + n0.y * n0.y + n0.z * n0.z;
+    const float len1 = n1.x * n1.x + n1.y * n1.y + n1.z * n1.z;
+
+    // the normals aren't normalized, so it's compared as cos^2 of the angle between them
+    if ((dot <= 0) || (dot * dot < 0.9999f * len0 * len1))
+        return false;
+
+    quad[0] = curr[notShared];
+    quad[1] = curr[(notShared + 1) % 3];
+    quad[3] = curr[(notShared + 2) % 3];
+
+    for (int i = 0; i < 3; ++i)
+    {
+        if ((next[i] != quad[1]) && (next[i] != quad[3]))
+            quad[2] = next[i];
+    }
+
+    return true;
+}
+
+///////////////////////////////////////////////////////////
+
+void RasterizeOccluder(const Mesh* pMesh, const Matrix* pWorldViewProj, const Vec4* pCameraPos)
+{
+    // transform the occluder into clip space, clip its faces which cross
+    // the near plane (the rest of the planes are handled by the bounding
+    // box of polygons in the buffer) and rasterize them
+    assert(s_OcclusionDepth && "the occlusion buffer isn't cleared");
+
+    if (!ReserveOccluderVertices(pMesh->numVertices))
+        return;
+
+    const int cap = s_OccluderCapacity;
+    const PointStreams clip = { s_OccluderStreams, s_OccluderStreams + cap, s_OccluderStreams + cap * 2, s_OccluderStreams + cap * 3 };
+
+    MatrixTransformPoints(pWorldViewProj, &pMesh->positions, &clip, pMesh->numVertices);
+
+    OccluderRowFunc rasterizeRow = RasterizeOccluderRow;
+#if SIMD_ENABLED
+    if (IsRenderFlag(RENDER_FLAG_SIMD))
+        rasterizeRow = RasterizeOccluderRowSimd;
+#endif
+
+    for (int i = 0; i < pMesh->numFaces; ++i)
+    {
+        const Face* pFace = pMesh->faces + i;
+
+        // the same backface test as in the main pass (against the object space face plane)
+        if (pCameraPos && IsFaceFacingAway(pMesh->facePlanes[i], *pCameraPos))
+            continue;
+
+        const Vec4 v0 = { clip.x[pFace->a], clip.y[pFace->a], clip.z[pFace->a], clip.w[pFace->a] };
+        const Vec4 v1 = { clip.x[pFace->b], clip.y[pFace->b], clip.z[pFace->b], clip.w[pFace->b] };
+        const Vec4 v2 = { clip.x[pFace->c], clip.y[pFace->c], clip.z[pFace->c], clip.w[pFace->c] };
+
+        // in clip space the near plane is z == 0
+        const int numBehind = (v0.z < 0) + (v1.z < 0) + (v2.z < 0);
+
+        if (numBehind == 3)
+            continue;
+
+        Vec3 points[OCCLUDER_MAX_EDGES];
+
+        if (numBehind == 0)
+        {
+            // merge the face with the next one if they form a quad which is
+            // entirely in front of the camera, so the pixels on the diagonal
+            // of the quad aren't lost
+            int quad[4];
+
+            if (GetQuadWithNextFace(pMesh, i, quad) &&
+                !(pCameraPos && IsFaceFacingAway(pMesh->facePlanes[i + 1], *pCameraPos)) &&
+                (clip.z[quad[2]] >= 0))
+            {
+                for (int j = 0; j < 4; ++j)
+                {
+                    const int idx = quad[j];
+                    points[j] = ClipToOcclusionBuffer((Vec4){ clip.x[idx], clip.y[idx], clip.z[idx], clip.w[idx] });
+                }
+
+                RasterizeOccluderPolygon(points, 4, rasterizeRow);
+                ++i;
+                continue;
+            }
+
+            points[0] = ClipToOcclusionBuffer(v0);
+            points[1] = ClipToOcclusionBuffer(v1);
+            points[2] = ClipToOcclusionBuffer(v2);
+
+            RasterizeOccluderPolygon(points, 3, rasterizeRow);
+            continue;
+        }
+
+        // a triangle clipped by a single plane has at most 4 vertices
+        Polygon polygon = CreatePolygonFromTriangle(v0, v1, v2, pFace->aUV, pFace->bUV, pFace->cUV);
+        ClipPolygonAgainstPlane(&polygon, NEAR_FRUSTUM_PLANE);
+
+        if ((polygon.numVertices < 3) || (polygon.numVertices > OCCLUDER_MAX_EDGES))
+            continue;
+
+        for (int j = 0; j < polygon.numVertices; ++j)
+            points[j] = ClipToOcclusionBuffer(polygon.vertices[j]);
+
+        RasterizeOccluderPolygon(points, polygon.numVertices, rasterizeRow);
+    }
+}
+
+///////////////////////////////////////////////////////////
+
+bool IsAabbOccluded(const Matrix* pViewProj, const Vec3 aabbMin, const Vec3 aabbMax)
+{
+    // project the corners of the box and test its screen rect against the
+    // buffer with the nearest depth of the box (the nearest point of a box
+    // is one of its corners); the box is hidden only if all the pixels of
+    // the rect have a nearer occluder
+    assert(s_OcclusionDepth && "the occlusion buffer isn't cleared");
+
+    float minX = FLT_MAX, minY = FLT_MAX;
+    float maxX = -FLT_MAX, maxY = -FLT_MAX;
+    float maxRecipW = 0;
+
+    for (int i = 0; i < 8; ++i)
+    {
+        const Vec4 corner =
+        {
+            (i & 1) ? aabbMax.x : aabbMin.x,
+            (i & 2) ? aabbMax.y : aabbMin.y,
+            (i & 4) ? aabbMax.z : aabbMin.z,
+            1.0f
+        };
+
+        Vec4 clip;
+        MatrixMulVec4(pViewProj, corner, &clip);
+
+        // the box crosses the plane of the camera so it can cover anything
+        if (clip.w <= 0)
+            return false;
+
+        const Vec3 p = ClipToOcclusionBuffer(clip);
+
+        minX = MIN(minX, p.x);
+        minY = MIN(minY, p.y);
+        maxX = MAX(maxX, p.x);
+        maxY = MAX(maxY, p.y);
+        maxRecipW = MAX(maxRecipW, p.z);
+    }
+
+    // all the pixels which the rect touches
+    const int x0 = (int)floorf(MAX(minX, 0.0f));
+    const int y0 = (int)floorf(MAX(minY, 0.0f));
+    const int x1 = (int)ceilf (MIN(maxX, (float)OCCLUSION_BUFFER_WIDTH));
+    const int y1 = (int)ceilf (MIN(maxY, (float)OCCLUSION_BUFFER_HEIGHT));
+
+    if ((x0 >= x1) || (y0 >= y1))
+        return false;
+
+    for (int y = y0; y < y1; ++y)
+    {
+        const float* row = s_OcclusionDepth + y * OCCLUSION_BUFFER_WIDTH;
+        int x = x0;
+
+#if SIMD_ENABLED
+        const SimdFloat boxDepth = SimdSetF(maxRecipW);
+
+        for (; x + SIMD_WIDTH <= x1; x += SIMD_WIDTH)
+        {
+            if (SimdMoveMask(SimdLessF(boxDepth, SimdLoadF(row + x))) != (1 << SIMD_WIDTH) - 1)
+                return false;
+        }
+#endif
+        for (; x < x1; ++x)
+        {
+            if (!(maxRecipW < row[x]))
+                return false;
+        }
+    }
+
+    return true;
+}
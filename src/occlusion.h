@@ -0,0 +1,40 @@
+// ==================================================================
+// Filename:    occlusion.h
+// Description: software occlusion culling of whole instances:
+//              a few selected occluder meshes are rasterized into a
+//              small depth buffer, and then the bounding boxes of
+//              instances are tested against it, so the instances
+//              which are hidden behind the occluders are skipped
+//              before their vertices are transformed
+//
+//              the buffer is conservative: a pixel is written only if
+//              it's completely covered by a single occluder polygon (a
+//              face, or a pair of coplanar faces forming a quad), and
+//              with the farthest depth of the polygon within the pixel,
+//              so a box is never rejected by mistake; the pixels which
+//              are covered only by a few polygons together stay empty,
+//              so some hidden boxes aren't rejected
+// ==================================================================
+#ifndef OCCLUSION_H
+#define OCCLUSION_H
+
+#include <stdbool.h>
+#include "mesh.h"
+
+// the buffer covers the whole screen whatever its aspect ratio is
+#define OCCLUSION_BUFFER_WIDTH  256
+#define OCCLUSION_BUFFER_HEIGHT 128
+
+void ClearOcclusionBuffer(void);
+void FreeOcclusionBuffer(void);
+
+// rasterize the faces of the mesh transformed into clip space with the matrix;
+// if the camera (in object space, see IsFaceFacingAway in mesh.h) is given then the
+// faces which are facing away from it are skipped, otherwise both sides
+// of the faces are rasterized
+void RasterizeOccluder(const Mesh* pMesh, const Matrix* pWorldViewProj, const Vec4* pCameraPos);
+
+// the world space box is completely hidden behind the rasterized occluders
+bool IsAabbOccluded(const Matrix* pViewProj, const Vec3 aabbMin, const Vec3 aabbMax);
+
+#endif
@@ -0,0 +1,154 @@
+// ==================================================================
+// Filename:    render_queue.c
+// Description: implementation of the SoA queue of triangles to render
+// ==================================================================
+#include "render_queue.h"
+#include "triangle.h"
+#include "array.h"
+#include "math_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+///////////////////////////////////////////////////////////
+
+static bool GrowStream(void** pStream, const int count, const int itemSize)
+{
+    void* stream = realloc(*pStream, (size_t)count * itemSize);
+
+    if (!stream)
+        return false;
+
+    *pStream = stream;
+    return true;
+}
+
+///////////////////////////////////////////////////////////
+
+static bool ReserveRenderQueue(RenderQueue* pQueue, const int numTriangles)
+{
+    // grow all the streams so they can hold numTriangles triangles
+    // (keeping the triangles which are already in the queue)
+    if (numTriangles <= pQueue->capacity)
+        return true;
+
+    const int capacity = MAX(numTriangles, pQueue->capacity * 2);
+    const int numVertices = capacity * 3;
+
+    const bool isGrown =
+        GrowStream((void**)&pQueue->x,              numVertices, sizeof(int32_t)) &&
+        GrowStream((void**)&pQueue->y,              numVertices, sizeof(int32_t)) &&
+        GrowStream((void**)&pQueue->recipW,         numVertices, sizeof(float))   &&
+        GrowStream((void**)&pQueue->u,              numVertices, sizeof(float))   &&
+        GrowStream((void**)&pQueue->v,              numVertices, sizeof(float))   &&
+        GrowStream((void**)&pQueue->depth,          capacity,    sizeof(float))   &&
+        GrowStream((void**)&pQueue->color,          capacity,    sizeof(uint32_t)) &&
+        GrowStream((void**)&pQueue->lightIntensity, capacity,    sizeof(float))   &&
+        GrowStream((void**)&pQueue->materialIdx,    capacity,    sizeof(uint16_t));
+
+    if (!isGrown)
+    {
+        // the streams which were grown are still valid for the old capacity
+        fprintf(stderr, "can't allocate memory for %d triangles to render\n", capacity);
+        return false;
+    }
+
+    pQueue->capacity = capacity;
+    return true;
+}
+
+///////////////////////////////////////////////////////////
+
+void ClearRenderQueue(RenderQueue* pQueue)
+{
+    pQueue->numTriangles = 0;
+    ArrayClear(pQueue->materials);
+}
+
+///////////////////////////////////////////////////////////
+
+void FreeRenderQueue(RenderQueue* pQueue)
+{
+    free(pQueue->x);
+    free(pQueue->y);
+    free(pQueue->recipW);
+    free(pQueue->u);
+    free(pQueue->v);
+    free(pQueue->depth);
+    free(pQueue->color);
+    free(pQueue->lightIntensity);
+    free(pQueue->materialIdx);
+
+    if (pQueue->materials)
+        ArrayFree((void**)&pQueue->materials);
+
+    *pQueue = (RenderQueue){ 0 };
+}
+
+///////////////////////////////////////////////////////////
+
+uint16_t AddRenderMaterial(RenderQueue* pQueue, const upng_t* pTexture, const bool isTextureOpaque)
+{
+    // meshes which share the render state (and are processed one
+    // after another) share the material too
+    const int numMaterials = ArrayLength(pQueue->materials);
+
+    if (numMaterials > 0)
+    {
+        const Material* pLast = pQueue->materials + numMaterials - 1;
+
+        if ((pLast->pTexture == pTexture) && (pLast->isTextureOpaque == isTextureOpaque))
+            return (uint16_t)(numMaterials - 1);
+    }
+
+    assert((numMaterials <= UINT16_MAX) && "too many materials in the render queue");
+
+    const Material material = { pTexture, isTextureOpaque };
+    ArrayPush(pQueue->materials, material);
+
+    return (uint16_t)numMaterials;
+}
+
+///////////////////////////////////////////////////////////
+
+void PushRenderTriangle(
+    RenderQueue* pQueue,
+    const Vec4* p0, const Vec4* p1, const Vec4* p2,
+    const Tex2 t0, const Tex2 t1, const Tex2 t2,
+    const uint32_t color,
+    const float lightIntensity,
+    const uint16_t materialIdx)
+{
+    if (!ReserveRenderQueue(pQueue, pQueue->numTriangles + 1))
+        return;
+
+    const int i = pQueue->numTriangles++;
+    const int k = i * 3;
+
+    // the rasterizer works with points snapped to 28.4 fixed-point
+    // and 1/w, so convert them once here instead of in each tile
+    pQueue->x[k + 0] = ToSubpixel(p0->x);
+    pQueue->x[k + 1] = ToSubpixel(p1->x);
+    pQueue->x[k + 2] = ToSubpixel(p2->x);
+
+    pQueue->y[k + 0] = ToSubpixel(p0->y);
+    pQueue->y[k + 1] = ToSubpixel(p1->y);
+    pQueue->y[k + 2] = ToSubpixel(p2->y);
+
+    pQueue->recipW[k + 0] = 1.0f / p0->w;
+    pQueue->recipW[k + 1] = 1.0f / p1->w;
+    pQueue->recipW[k + 2] = 1.0f / p2->w;
+
+    pQueue->u[k + 0] = t0.u;
+    pQueue->u[k + 1] = t1.u;
+    pQueue->u[k + 2] = t2.u;
+
+    pQueue->v[k + 0] = t0.v;
+    pQueue->v[k + 1] = t1.v;
+    pQueue->v[k + 2] = t2.v;
+
+    pQueue->depth[i]          = p0->w + p1->w + p2->w;
+    pQueue->color[i]          = color;
+    pQueue->lightIntensity[i] = lightIntensity;
+    pQueue->materialIdx[i]    = materialIdx;
+}
@@ -0,0 +1,72 @@
+// ==================================================================
+// Filename:    render_queue.h
+// Description: a compact queue of the screen space triangles which
+//              are rendered in the current frame; it's stored as a
+//              structure of arrays, so each stage of the pipeline
+//              (sorting, binning, rasterization) reads only the
+//              streams it needs:
+//
+//              per vertex (3 per triangle, the vertices of the
+//              triangle i are at [3*i, 3*i + 2]):
+//                - x, y: screen coords snapped to 28.4 fixed-point
+//                - 1/w, u, v
+//
+//              per triangle:
+//                - depth key (the sum of w of the vertices)
+//                - color, light intensity and material idx
+// ==================================================================
+#ifndef RENDER_QUEUE_H
+#define RENDER_QUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "vector.h"
+#include "texture.h"
+#include "upng.h"
+
+// render state which is shared by all the triangles of a mesh
+typedef struct
+{
+    const upng_t* pTexture;
+    bool isTextureOpaque;       // the texture has no transparent texels (so it doesn't need the alpha test)
+} Material;
+
+typedef struct
+{
+    // per vertex streams
+    int32_t* x;                 // 28.4 fixed-point
+    int32_t* y;
+    float*   recipW;            // 1/w
+    float*   u;
+    float*   v;
+
+    // per triangle streams
+    float*    depth;            // the sum of w of the vertices (it has the same order as the average depth)
+    uint32_t* color;
+    float*    lightIntensity;
+    uint16_t* materialIdx;
+
+    Material* materials;        // dynamic arr (see array.h)
+
+    int numTriangles;
+    int capacity;               // the number of triangles the streams can hold
+} RenderQueue;
+
+
+// the queue keeps its memory from frame to frame
+void ClearRenderQueue(RenderQueue* pQueue);
+void FreeRenderQueue(RenderQueue* pQueue);
+
+// returns an idx of the material for the next pushed triangles
+uint16_t AddRenderMaterial(RenderQueue* pQueue, const upng_t* pTexture, const bool isTextureOpaque);
+
+// push a triangle with screen space points (x, y, z, w) into the queue
+void PushRenderTriangle(
+    RenderQueue* pQueue,
+    const Vec4* p0, const Vec4* p1, const Vec4* p2,
+    const Tex2 t0, const Tex2 t1, const Tex2 t2,
+    const uint32_t color,
+    const float lightIntensity,
+    const uint16_t materialIdx);
+
+#endif
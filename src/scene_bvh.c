@@ -0,0 +1,362 @@
+// ==================================================================
+// Filename:    scene_bvh.c
+// Description: implementation of the BVH over the scene instances
+// ==================================================================
+#include "scene_bvh.h"
+#include "mesh.h"
+#include "clipping.h"
+#include "array.h"
+#include "math_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#define BVH_MAX_LEAF_SIZE   4       // the max number of instances in a leaf
+#define BVH_MAX_DEPTH       64
+#define BVH_FULL_REFIT_RATIO 8      // refit all the nodes if more than 1/8 of the instances are moved
+
+typedef struct
+{
+    Vec3 aabbMin;
+    Vec3 aabbMax;
+    int  firstInstance;             // the subtree holds s_BvhInstances[first, first + num)
+    int  numInstances;
+    int  left;                      // child nodes (-1 for leaves)
+    int  right;
+    int  parent;                    // -1 for the root
+} BvhNode;
+
+typedef struct
+{
+    Vec3 aabbMin;
+    Vec3 aabbMax;
+} BvhBox;
+
+static BvhNode* s_BvhNodes       = NULL;   // dynamic arrs (see array.h); the root is 0
+static int*     s_BvhInstances   = NULL;   // instance idxs ordered so each node holds a range
+static BvhBox*  s_InstanceBoxes  = NULL;   // world space AABBs by instance idx
+static int*     s_InstanceLeaves = NULL;   // the leaf node of each instance
+static int*     s_VisibleInstances = NULL; // the result of CullSceneBvh
+
+static int      s_NumBuiltInstances = 0;
+
+
+///////////////////////////////////////////////////////////
+
+static inline Vec3 MinVec3(const Vec3 a, const Vec3 b)
+{
+    return Vec3Init(MIN(a.x, b.x), MIN(a.y, b.y), MIN(a.z, b.z));
+}
+
+static inline Vec3 MaxVec3(const Vec3 a, const Vec3 b)
+{
+    return Vec3Init(MAX(a.x, b.x), MAX(a.y, b.y), MAX(a.z, b.z));
+}
+
+static inline float GetAxis(const Vec3 v, const int axis)
+{
+    return (axis == 0) ? v.x : (axis == 1) ? v.y : v.z;
+}
+
+static inline float GetCentroid(const int instanceIdx, const int axis)
+{
+    const BvhBox* pBox = s_InstanceBoxes + instanceIdx;
+    return GetAxis(pBox->aabbMin, axis) + GetAxis(pBox->aabbMax, axis);
+}
+
+///////////////////////////////////////////////////////////
+
+static void ComputeNodeBounds(BvhNode* pNode)
+{
+    // a leaf is bounded by its instances, an inner node by its children
+    if (pNode->left < 0)
+    {
+        const BvhBox* pBox = s_InstanceBoxes + s_BvhInstances[pNode->firstInstance];
+        pNode->aabbMin = pBox->aabbMin;
+        pNode->aabbMax = pBox->aabbMax;
+
+        for (int i = 1; i < pNode->numInstances; ++i)
+        {
+            pBox = s_InstanceBoxes + s_BvhInstances[pNode->firstInstance + i];
+            pNode->aabbMin = MinVec3(pNode->aabbMin, pBox->aabbMin);
+            pNode->aabbMax = MaxVec3(pNode->aabbMax, pBox->aabbMax);
+        }
+    }
+    else
+    {
+        const BvhNode* pLeft  = s_BvhNodes + pNode->left;
+        const BvhNode* pRight = s_BvhNodes + pNode->right;
+        pNode->aabbMin = MinVec3(pLeft->aabbMin, pRight->aabbMin);
+        pNode->aabbMax = MaxVec3(pLeft->aabbMax, pRight->aabbMax);
+    }
+}
+
+///////////////////////////////////////////////////////////
+
+static int PartitionInstances(const int first, const int num, const Vec3 centroidMin, const Vec3 centroidMax)
+{
+    // split the instances at the middle of the longest axis of
+    // their centroids bounds; returns the number of instances
+    // which go into the left child
+    const Vec3 size = Vec3Sub(centroidMax, centroidMin);
+    const int axis = (size.x >= size.y) ? ((size.x >= size.z) ? 0 : 2) : ((size.y >= size.z) ? 1 : 2);
+    const float split = GetAxis(centroidMin, axis) + GetAxis(size, axis) * 0.5f;
+
+    int* instances = s_BvhInstances + first;
+    int i = 0;
+    int j = num - 1;
+
+    while (i <= j)
+    {
+        if (GetCentroid(instances[i], axis) < split)
+        {
+            ++i;
+        }
+        else
+        {
+            const int tmp = instances[i];
+            instances[i] = instances[j];
+            instances[j--] = tmp;
+        }
+    }
+
+    // all the centroids are on one side (e.g. instances at the same
+    // point) so just split the range in halves to keep the tree balanced
+    if ((i == 0) || (i == num))
+        return num / 2;
+
+    return i;
+}
+
+///////////////////////////////////////////////////////////
+
+static int BuildNode(const int parent, const int first, const int num, const int depth)
+{
+    assert((depth < BVH_MAX_DEPTH) && "the BVH is too deep");
+
+    const BvhNode node = { {0,0,0}, {0,0,0}, first, num, -1, -1, parent };
+    ArrayPush(s_BvhNodes, node);
+    const int nodeIdx = ArrayLength(s_BvhNodes) - 1;
+
+    if (num <= BVH_MAX_LEAF_SIZE)
+    {
+        for (int i = first; i < first + num; ++i)
+            s_InstanceLeaves[s_BvhInstances[i]] = nodeIdx;
+
+        ComputeNodeBounds(s_BvhNodes + nodeIdx);
+        return nodeIdx;
+    }
+
+    // the centroids are stored doubled (min + max) which doesn't change the split
+    Vec3 centroidMin = Vec3Init(GetCentroid(s_BvhInstances[first], 0), GetCentroid(s_BvhInstances[first], 1), GetCentroid(s_BvhInstances[first], 2));
+    Vec3 centroidMax = centroidMin;
+
+    for (int i = first + 1; i < first + num; ++i)
+    {
+        const int idx = s_BvhInstances[i];
+        const Vec3 centroid = Vec3Init(GetCentroid(idx, 0), GetCentroid(idx, 1), GetCentroid(idx, 2));
+        centroidMin = MinVec3(centroidMin, centroid);
+        centroidMax = MaxVec3(centroidMax, centroid);
+    }
+
+    const int numLeft = PartitionInstances(first, num, centroidMin, centroidMax);
+
+    // the nodes arr can be reallocated during the recursion so set the children by idx
+    const int left  = BuildNode(nodeIdx, first, numLeft, depth + 1);
+    const int right = BuildNode(nodeIdx, first + numLeft, num - numLeft, depth + 1);
+
+    s_BvhNodes[nodeIdx].left  = left;
+    s_BvhNodes[nodeIdx].right = right;
+    ComputeNodeBounds(s_BvhNodes + nodeIdx);
+
+    return nodeIdx;
+}
+
+///////////////////////////////////////////////////////////
+
+static void UpdateInstanceBox(const int instanceIdx)
+{
+    BvhBox* pBox = s_InstanceBoxes + instanceIdx;
+    GetInstanceWorldAabb(GetMeshInstanceByIdx(instanceIdx), &pBox->aabbMin, &pBox->aabbMax);
+}
+
+///////////////////////////////////////////////////////////
+
+static void BuildSceneBvh(void)
+{
+    const int numInstances = GetNumMeshInstances();
+
+    ArrayClear(s_BvhNodes);
+    ArrayClear(s_BvhInstances);
+    ArrayClear(s_InstanceBoxes);
+    ArrayClear(s_InstanceLeaves);
+
+    s_NumBuiltInstances = numInstances;
+
+    if (numInstances == 0)
+        return;
+
+    s_BvhInstances   = ArrayHold(s_BvhInstances,   numInstances, sizeof(int));
+    s_InstanceBoxes  = ArrayHold(s_InstanceBoxes,  numInstances, sizeof(BvhBox));
+    s_InstanceLeaves = ArrayHold(s_InstanceLeaves, numInstances, sizeof(int));
+
+    for (int i = 0; i < numInstances; ++i)
+    {
+        s_BvhInstances[i] = i;
+        UpdateInstanceBox(i);
+    }
+
+    BuildNode(-1, 0, numInstances, 0);
+}
+
+///////////////////////////////////////////////////////////
+
+static void RefitSceneBvh(const int instanceIdx)
+{
+    // update the box of the moved instance and then the bounds of
+    // the nodes up from its leaf; stop when a node doesn't change
+    // since its ancestors are already up to date
+    UpdateInstanceBox(instanceIdx);
+
+    for (int nodeIdx = s_InstanceLeaves[instanceIdx]; nodeIdx >= 0; )
+    {
+        BvhNode* pNode = s_BvhNodes + nodeIdx;
+        const Vec3 oldMin = pNode->aabbMin;
+        const Vec3 oldMax = pNode->aabbMax;
+
+        ComputeNodeBounds(pNode);
+
+        if ((oldMin.x == pNode->aabbMin.x) && (oldMin.y == pNode->aabbMin.y) && (oldMin.z == pNode->aabbMin.z) &&
+            (oldMax.x == pNode->aabbMax.x) && (oldMax.y == pNode->aabbMax.y) && (oldMax.z == pNode->aabbMax.z))
+            break;
+
+        nodeIdx = pNode->parent;
+    }
+}
+
+///////////////////////////////////////////////////////////
+
+void UpdateSceneBvh(void)
+{
+    // the tree is built over a fixed set of instances so rebuild it
+    // when instances are added; otherwise only refit it by the moved
+    // instances (refitting keeps the topology so the tree may become
+    // looser if instances move far from where they were at building)
+    if (GetNumMeshInstances() != s_NumBuiltInstances)
+    {
+        BuildSceneBvh();
+    }
+    else if (GetNumMovedInstances() > 0)
+    {
+        const int* movedInstances = GetMovedInstances();
+        const int numMoved = GetNumMovedInstances();
+
+        if (numMoved * BVH_FULL_REFIT_RATIO < s_NumBuiltInstances)
+        {
+            for (int i = 0; i < numMoved; ++i)
+                RefitSceneBvh(movedInstances[i]);
+        }
+        else
+        {
+            // many instances are moved so the paths up from their leaves
+            // overlap: it's cheaper to visit each node once; the children
+            // are always after their parent so go from the end of the arr
+            for (int i = 0; i < numMoved; ++i)
+                UpdateInstanceBox(movedInstances[i]);
+
+            for (int nodeIdx = ArrayLength(s_BvhNodes) - 1; nodeIdx >= 0; --nodeIdx)
+                ComputeNodeBounds(s_BvhNodes + nodeIdx);
+        }
+    }
+
+    ClearMovedInstances();
+}
+
+///////////////////////////////////////////////////////////
+
+static void AddSubtreeInstances(const BvhNode* pNode)
+{
+    // the whole subtree is visible: its instances are a range of s_BvhInstances
+    const int first = ArrayLength(s_VisibleInstances);
+
+    s_VisibleInstances = ArrayHold(s_VisibleInstances, pNode->numInstances, sizeof(int));
+
+    for (int i = 0; i < pNode->numInstances; ++i)
+        s_VisibleInstances[first + i] = s_BvhInstances[pNode->firstInstance + i];
+}
+
+///////////////////////////////////////////////////////////
+
+int* CullSceneBvh(const Matrix* pViewProj)
+{
+    // traverse the tree with frustum planes in world space; skip the nodes
+    // which are outside and take the nodes which are inside as a whole
+    ArrayClear(s_VisibleInstances);
+
+    if (ArrayLength(s_BvhNodes) == 0)
+        return s_VisibleInstances;
+
+    Vec4 planes[6];
+    ExtractFrustumPlanes(pViewProj, planes);
+
+    int stack[BVH_MAX_DEPTH];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0)
+    {
+        const BvhNode* pNode = s_BvhNodes + stack[--stackSize];
+
+        if (IsAabbOutsideFrustum(planes, pNode->aabbMin, pNode->aabbMax))
+            continue;
+
+        if (IsAabbInsideFrustum(planes, pNode->aabbMin, pNode->aabbMax))
+        {
+            AddSubtreeInstances(pNode);
+            continue;
+        }
+
+        if (pNode->left >= 0)
+        {
+            // the right child is pushed first so the left one is visited first
+            assert((stackSize + 2 <= BVH_MAX_DEPTH) && "the BVH traversal stack is overflowed");
+            stack[stackSize++] = pNode->right;
+            stack[stackSize++] = pNode->left;
+            continue;
+        }
+
+        // a leaf which intersects the frustum: test its instances one by one
+        for (int i = pNode->firstInstance; i < pNode->firstInstance + pNode->numInstances; ++i)
+        {
+            const int instanceIdx = s_BvhInstances[i];
+            const BvhBox* pBox = s_InstanceBoxes + instanceIdx;
+
+            if (!IsAabbOutsideFrustum(planes, pBox->aabbMin, pBox->aabbMax))
+                ArrayPush(s_VisibleInstances, instanceIdx);
+        }
+    }
+
+    return s_VisibleInstances;
+}
+
+///////////////////////////////////////////////////////////
+
+void FreeSceneBvh(void)
+{
+    if (s_BvhNodes)
+        ArrayFree((void**)&s_BvhNodes);
+
+    if (s_BvhInstances)
+        ArrayFree((void**)&s_BvhInstances);
+
+    if (s_InstanceBoxes)
+        ArrayFree((void**)&s_InstanceBoxes);
+
+    if (s_InstanceLeaves)
+        ArrayFree((void**)&s_InstanceLeaves);
+
+    if (s_VisibleInstances)
+        ArrayFree((void**)&s_VisibleInstances);
+
+    s_NumBuiltInstances = 0;
+}
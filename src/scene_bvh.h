@@ -0,0 +1,30 @@
+// ==================================================================
+// Filename:    scene_bvh.h
+// Description: a bounding volume hierarchy over world space AABBs
+//              of all the mesh instances of the scene; it's used for
+//              hierarchical frustum culling: the subtrees which are
+//              outside the frustum are skipped as a whole, and the
+//              subtrees which are inside are accepted without testing
+//              their instances, so the cost of culling grows with the
+//              number of visible instances and not with the total
+//
+//              the tree is rebuilt when instances are added, and
+//              refitted (only up from the leaves of the moved
+//              instances) when instances are moved
+// ==================================================================
+#ifndef SCENE_BVH_H
+#define SCENE_BVH_H
+
+#include "matrix.h"
+
+// rebuild or refit the tree so it matches the current instances
+void UpdateSceneBvh(void);
+
+// returns a dynamic arr (see array.h) of idxs of the instances which
+// may be visible with the input view-projection matrix; the arr is owned
+// by the BVH and it's valid until the next call
+int* CullSceneBvh(const Matrix* pViewProj);
+
+void FreeSceneBvh(void);
+
+#endif
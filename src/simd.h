@@ -0,0 +1,159 @@
+// ==================================================================
+// Filename:    simd.h
+// Description: a thin wrapper over SSE2/AVX2 intrinsics, so the
+//              vectorized kernels are written once and processed
+//              either 4 (SSE2) or 8 (AVX2) lanes per iteration;
+//              if neither is available SIMD_ENABLED is 0 and only
+//              the scalar code paths are compiled
+// ==================================================================
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <stdint.h>
+
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+#define SIMD_ENABLED 1
+#define SIMD_WIDTH   8
+
+typedef __m256  SimdFloat;
+typedef __m256i SimdInt;         // also used for lane masks (all bits set in a lane)
+
+static inline SimdFloat SimdSetF(const float v)                 { return _mm256_set1_ps(v); }
+static inline SimdFloat SimdLoadF(const float* p)               { return _mm256_loadu_ps(p); }
+static inline void      SimdStoreF(float* p, const SimdFloat v) { _mm256_storeu_ps(p, v); }
+static inline SimdFloat SimdAddF(const SimdFloat a, const SimdFloat b) { return _mm256_add_ps(a, b); }
+static inline SimdFloat SimdSubF(const SimdFloat a, const SimdFloat b) { return _mm256_sub_ps(a, b); }
+static inline SimdFloat SimdMulF(const SimdFloat a, const SimdFloat b) { return _mm256_mul_ps(a, b); }
+static inline SimdFloat SimdDivF(const SimdFloat a, const SimdFloat b) { return _mm256_div_ps(a, b); }
+static inline SimdFloat SimdMinF(const SimdFloat a, const SimdFloat b) { return _mm256_min_ps(a, b); }
+static inline SimdFloat SimdMaxF(const SimdFloat a, const SimdFloat b) { return _mm256_max_ps(a, b); }
+static inline SimdInt   SimdLessF(const SimdFloat a, const SimdFloat b) { return _mm256_castps_si256(_mm256_cmp_ps(a, b, _CMP_LT_OQ)); }
+static inline SimdInt   SimdEqualF(const SimdFloat a, const SimdFloat b) { return _mm256_castps_si256(_mm256_cmp_ps(a, b, _CMP_EQ_OQ)); }
+static inline SimdFloat SimdLaneIdxF(void)                      { return _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7); }
+
+static inline SimdInt   SimdSetI(const int v)                   { return _mm256_set1_epi32(v); }
+static inline SimdInt   SimdLoadI(const void* p)                { return _mm256_loadu_si256((const __m256i*)p); }
+static inline void      SimdStoreI(void* p, const SimdInt v)    { _mm256_storeu_si256((__m256i*)p, v); }
+static inline SimdInt   SimdAddI(const SimdInt a, const SimdInt b) { return _mm256_add_epi32(a, b); }
+static inline SimdInt   SimdSubI(const SimdInt a, const SimdInt b) { return _mm256_sub_epi32(a, b); }
+static inline SimdInt   SimdAndI(const SimdInt a, const SimdInt b) { return _mm256_and_si256(a, b); }
+static inline SimdInt   SimdOrI (const SimdInt a, const SimdInt b) { return _mm256_or_si256(a, b); }
+static inline SimdInt   SimdXorI(const SimdInt a, const SimdInt b) { return _mm256_xor_si256(a, b); }
+static inline SimdInt   SimdAndNotI(const SimdInt a, const SimdInt b) { return _mm256_andnot_si256(a, b); }  // ~a & b
+static inline SimdInt   SimdEqualI(const SimdInt a, const SimdInt b)  { return _mm256_cmpeq_epi32(a, b); }
+static inline SimdInt   SimdShiftLeftI(const SimdInt a, const int n)  { return _mm256_sll_epi32(a, _mm_cvtsi32_si128(n)); }
+static inline SimdInt   SimdShiftRightArithI(const SimdInt a, const int n) { return _mm256_sra_epi32(a, _mm_cvtsi32_si128(n)); }
+
+static inline SimdInt   SimdFloatToInt(const SimdFloat v)       { return _mm256_cvttps_epi32(v); }   // truncation like (int)
+static inline SimdFloat SimdIntToFloat(const SimdInt v)         { return _mm256_cvtepi32_ps(v); }
+static inline int       SimdMoveMask(const SimdInt mask)        { return _mm256_movemask_ps(_mm256_castsi256_ps(mask)); }
+static inline SimdInt   SimdCastFToI(const SimdFloat v)         { return _mm256_castps_si256(v); }   // reinterpret bits
+static inline SimdFloat SimdCastIToF(const SimdInt v)           { return _mm256_castsi256_ps(v); }
+
+static inline SimdInt SimdGatherI(const uint32_t* base, const SimdInt idxs)
+{
+    return _mm256_i32gather_epi32((const int*)base, idxs, 4);
+}
+
+#elif defined(__SSE2__)
+
+#include <emmintrin.h>
+
+#define SIMD_ENABLED 1
+#define SIMD_WIDTH   4
+
+typedef __m128  SimdFloat;
+typedef __m128i SimdInt;         // also used for lane masks (all bits set in a lane)
+
+static inline SimdFloat SimdSetF(const float v)                 { return _mm_set1_ps(v); }
+static inline SimdFloat SimdLoadF(const float* p)               { return _mm_loadu_ps(p); }
+static inline void      SimdStoreF(float* p, const SimdFloat v) { _mm_storeu_ps(p, v); }
+static inline SimdFloat SimdAddF(const SimdFloat a, const SimdFloat b) { return _mm_add_ps(a, b); }
+static inline SimdFloat SimdSubF(const SimdFloat a, const SimdFloat b) { return _mm_sub_ps(a, b); }
+static inline SimdFloat SimdMulF(const SimdFloat a, const SimdFloat b) { return _mm_mul_ps(a, b); }
+static inline SimdFloat SimdDivF(const SimdFloat a, const SimdFloat b) { return _mm_div_ps(a, b); }
+static inline SimdFloat SimdMinF(const SimdFloat a, const SimdFloat b) { return _mm_min_ps(a, b); }
+static inline SimdFloat SimdMaxF(const SimdFloat a, const SimdFloat b) { return _mm_max_ps(a, b); }
+static inline SimdInt   SimdLessF(const SimdFloat a, const SimdFloat b) { return _mm_castps_si128(_mm_cmplt_ps(a, b)); }
+static inline SimdInt   SimdEqualF(const SimdFloat a, const SimdFloat b) { return _mm_castps_si128(_mm_cmpeq_ps(a, b)); }
+static inline SimdFloat SimdLaneIdxF(void)                      { return _mm_setr_ps(0, 1, 2, 3); }
+
+static inline SimdInt   SimdSetI(const int v)                   { return _mm_set1_epi32(v); }
+static inline SimdInt   SimdLoadI(const void* p)                { return _mm_loadu_si128((const __m128i*)p); }
+static inline void      SimdStoreI(void* p, const SimdInt v)    { _mm_storeu_si128((__m128i*)p, v); }
+static inline SimdInt   SimdAddI(const SimdInt a, const SimdInt b) { return _mm_add_epi32(a, b); }
+static inline SimdInt   SimdSubI(const SimdInt a, const SimdInt b) { return _mm_sub_epi32(a, b); }
+static inline SimdInt   SimdAndI(const SimdInt a, const SimdInt b) { return _mm_and_si128(a, b); }
+static inline SimdInt   SimdOrI (const SimdInt a, const SimdInt b) { return _mm_or_si128(a, b); }
+static inline SimdInt   SimdXorI(const SimdInt a, const SimdInt b) { return _mm_xor_si128(a, b); }
+static inline SimdInt   SimdAndNotI(const SimdInt a, const SimdInt b) { return _mm_andnot_si128(a, b); }  // ~a & b
+static inline SimdInt   SimdEqualI(const SimdInt a, const SimdInt b)  { return _mm_cmpeq_epi32(a, b); }
+static inline SimdInt   SimdShiftLeftI(const SimdInt a, const int n)  { return _mm_sll_epi32(a, _mm_cvtsi32_si128(n)); }
+static inline SimdInt   SimdShiftRightArithI(const SimdInt a, const int n) { return _mm_sra_epi32(a, _mm_cvtsi32_si128(n)); }
+
+static inline SimdInt   SimdFloatToInt(const SimdFloat v)       { return _mm_cvttps_epi32(v); }   // truncation like (int)
+static inline SimdFloat SimdIntToFloat(const SimdInt v)         { return _mm_cvtepi32_ps(v); }
+static inline int       SimdMoveMask(const SimdInt mask)        { return _mm_movemask_ps(_mm_castsi128_ps(mask)); }
+static inline SimdInt   SimdCastFToI(const SimdFloat v)         { return _mm_castps_si128(v); }      // reinterpret bits
+static inline SimdFloat SimdCastIToF(const SimdInt v)           { return _mm_castsi128_ps(v); }
+
+static inline SimdInt SimdGatherI(const uint32_t* base, const SimdInt idxs)
+{
+    // SSE2 has no gather instruction so load lane by lane
+    int32_t lanes[SIMD_WIDTH];
+    _mm_storeu_si128((__m128i*)lanes, idxs);
+    return _mm_setr_epi32(base[lanes[0]], base[lanes[1]], base[lanes[2]], base[lanes[3]]);
+}
+
+#else
+
+#define SIMD_ENABLED 0
+#define SIMD_WIDTH   1
+
+#endif
+
+
+#if SIMD_ENABLED
+
+// ==================================================================
+// common helpers built on top of the wrappers above
+// ==================================================================
+
+static inline SimdInt SimdAbsI(const SimdInt v)
+{
+    // |v| = (v ^ sign) - sign, where sign is all ones for negative lanes
+    const SimdInt sign = SimdShiftRightArithI(v, 31);
+    return SimdSubI(SimdXorI(v, sign), sign);
+}
+
+static inline SimdInt SimdSelectI(const SimdInt mask, const SimdInt a, const SimdInt b)
+{
+    // take lanes of a where the mask is set, and lanes of b otherwise
+    return SimdOrI(SimdAndI(mask, a), SimdAndNotI(mask, b));
+}
+
+static inline SimdFloat SimdSelectF(const SimdInt mask, const SimdFloat a, const SimdFloat b)
+{
+    return SimdCastIToF(SimdSelectI(mask, SimdCastFToI(a), SimdCastFToI(b)));
+}
+
+static inline float SimdReduceMaxF(const SimdFloat v)
+{
+    // the max of all the lanes
+    float lanes[SIMD_WIDTH];
+    SimdStoreF(lanes, v);
+
+    float maxValue = lanes[0];
+
+    for (int i = 1; i < SIMD_WIDTH; ++i)
+        maxValue = (lanes[i] > maxValue) ? lanes[i] : maxValue;
+
+    return maxValue;
+}
+
+#endif
+
+#endif
@@ -31,4 +31,23 @@ void LoadPngTextureData(upng_t** ppTexture, const char* filename)
     }
 }
 
+///////////////////////////////////////////////////////////
+
+bool IsTextureOpaque(const upng_t* pTexture)
+{
+    // check if the texture has no fully transparent texels
+    // (so triangles with this texture don't need the alpha test)
+    if (!pTexture || (upng_get_error(pTexture) != UPNG_EOK) || (upng_get_format(pTexture) != UPNG_RGBA8))
+        return false;
+
+    const uint32_t* texels = (const uint32_t*)upng_get_buffer(pTexture);
+    const int numTexels = upng_get_width(pTexture) * upng_get_height(pTexture);
 
+    for (int i = 0; i < numTexels; ++i)
+    {
+        if ((texels[i] & 0xFF000000) == 0)
+            return false;
+    }
+
+    return true;
+}
@@ -9,6 +9,7 @@
 #define TEXTURE_H
 
 #include "upng.h"
+#include <stdbool.h>
 
 typedef struct
 {
@@ -17,5 +18,6 @@ typedef struct
 } Tex2;
 
 void LoadPngTextureData(upng_t** ppTexture, const char* filename);
+bool IsTextureOpaque(const upng_t* pTexture);
 
 #endif
@@ -0,0 +1,200 @@
+// ==================================================================
+// Filename:    thread_pool.c
+// Description: implementation of the worker threads pool
+// ==================================================================
+#define _POSIX_C_SOURCE 200112L    // for sysconf()
+
+#include "thread_pool.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#define MAX_NUM_THREADS 64
+
+static pthread_t       s_Workers[MAX_NUM_THREADS];
+static int             s_NumWorkers = 0;    // the main thread isn't counted here
+
+static pthread_mutex_t s_Mutex    = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  s_StartJobs = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  s_JobsDone  = PTHREAD_COND_INITIALIZER;
+
+// the current batch of jobs (guarded by the mutex)
+static JobFunc s_JobFunc        = NULL;
+static void*   s_pJobData       = NULL;
+static int     s_NumJobs        = 0;
+static int     s_NextJobIdx     = 0;
+static int     s_NumFinishedJobs = 0;
+static int     s_BatchId        = 0;        // is increased for each new batch
+static bool    s_IsQuit         = false;
+
+///////////////////////////////////////////////////////////
+
+static void ExecuteJobs(void)
+{
+    // grab the jobs of the current batch one by one until all of them are taken
+    for (;;)
+    {
+        pthread_mutex_lock(&s_Mutex);
+        const int jobIdx   = s_NextJobIdx++;
+        const int numJobs  = s_NumJobs;
+        JobFunc   jobFunc  = s_JobFunc;
+        void*     pJobData = s_pJobData;
+        pthread_mutex_unlock(&s_Mutex);
+
+        if (jobIdx >= numJobs)
+            break;
+
+        jobFunc(jobIdx, pJobData);
+
+        pthread_mutex_lock(&s_Mutex);
+
+        if (++s_NumFinishedJobs == s_NumJobs)
+            pthread_cond_signal(&s_JobsDone);
+
+        pthread_mutex_unlock(&s_Mutex);
+    }
+}
+
+///////////////////////////////////////////////////////////
+
+static void* WorkerThreadFunc(void* pArg)
+{
+    (void)pArg;
+    int lastBatchId = 0;
+
+    pthread_mutex_lock(&s_Mutex);
+
+    for (;;)
+    {
+        // sleep until there is a new batch of jobs or the pool is destroyed
+        while (!s_IsQuit && (s_BatchId == lastBatchId))
+            pthread_cond_wait(&s_StartJobs, &s_Mutex);
+
+        if (s_IsQuit)
+            break;
+
+        lastBatchId = s_BatchId;
+        pthread_mutex_unlock(&s_Mutex);
+
+        ExecuteJobs();
+
+        pthread_mutex_lock(&s_Mutex);
+    }
+
+    pthread_mutex_unlock(&s_Mutex);
+    return NULL;
+}
+
+///////////////////////////////////////////////////////////
+
+void InitThreadPool(const int numThreads)
+{
+    // create (numThreads - 1) workers since the main thread executes jobs too
+
+    assert((numThreads > 0) && "invalid input args");
+
+    s_IsQuit     = false;
+    s_NumWorkers = 0;
+
+    const int numWorkers = (numThreads > MAX_NUM_THREADS) ? MAX_NUM_THREADS - 1 : numThreads - 1;
+
+    for (int i = 0; i < numWorkers; ++i)
+    {
+        if (pthread_create(&s_Workers[i], NULL, WorkerThreadFunc, NULL) != 0)
+        {
+            fprintf(stderr, "ERROR: can't create a worker thread #%d\n", i);
+            break;
+        }
+
+        s_NumWorkers++;
+    }
+
+    printf("Thread pool is initialized: %d threads\n", GetNumThreads());
+}
+
+///////////////////////////////////////////////////////////
+
+void FreeThreadPool(void)
+{
+    // wake up all the workers and wait until they are finished
+
+    pthread_mutex_lock(&s_Mutex);
+    s_IsQuit = true;
+    pthread_cond_broadcast(&s_StartJobs);
+    pthread_mutex_unlock(&s_Mutex);
+
+    for (int i = 0; i < s_NumWorkers; ++i)
+        pthread_join(s_Workers[i], NULL);
+
+    s_NumWorkers = 0;
+}
+
+///////////////////////////////////////////////////////////
+
+int GetNumThreads(void)
+{
+    return s_NumWorkers + 1;
+}
+
+///////////////////////////////////////////////////////////
+
+int GetDefaultNumThreads(void)
+{
+    // the number of threads can be set with the RENDER_THREADS
+    // environment variable, otherwise use all the CPU cores
+
+    const char* envValue = getenv("RENDER_THREADS");
+
+    if (envValue)
+    {
+        const int numThreads = atoi(envValue);
+
+        if (numThreads > 0)
+            return numThreads;
+    }
+
+    const long numCores = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return (numCores > 0) ? (int)numCores : 1;
+}
+
+///////////////////////////////////////////////////////////
+
+void RunJobs(JobFunc jobFunc, void* pData, const int numJobs)
+{
+    assert((jobFunc != NULL) && "invalid input args");
+
+    // there are no workers so just execute all the jobs in place
+    if (s_NumWorkers == 0)
+    {
+        for (int i = 0; i < numJobs; ++i)
+            jobFunc(i, pData);
+
+        return;
+    }
+
+    // publish a new batch of jobs and wake up the workers
+    pthread_mutex_lock(&s_Mutex);
+    s_JobFunc         = jobFunc;
+    s_pJobData        = pData;
+    s_NumJobs         = numJobs;
+    s_NextJobIdx      = 0;
+    s_NumFinishedJobs = 0;
+    s_BatchId++;
+    pthread_cond_broadcast(&s_StartJobs);
+    pthread_mutex_unlock(&s_Mutex);
+
+    // the main thread executes jobs as well
+    ExecuteJobs();
+
+    // wait for the jobs which are still executed by the workers
+    pthread_mutex_lock(&s_Mutex);
+
+    while (s_NumFinishedJobs < s_NumJobs)
+        pthread_cond_wait(&s_JobsDone, &s_Mutex);
+
+    pthread_mutex_unlock(&s_Mutex);
+}
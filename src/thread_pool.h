@@ -0,0 +1,23 @@
+// ==================================================================
+// Filename:    thread_pool.h
+// Description: a pool of worker threads which execute a batch of
+//              independent jobs in parallel (for instance: rasterize
+//              each screen tile by its own thread); the main thread
+//              takes part in the execution as well
+// ==================================================================
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+// a job function is called once for each job idx in range [0, numJobs)
+typedef void (*JobFunc)(const int jobIdx, void* pData);
+
+void InitThreadPool(const int numThreads);
+void FreeThreadPool(void);
+
+int GetNumThreads(void);
+int GetDefaultNumThreads(void);
+
+// execute the batch of jobs and wait until all of them are finished
+void RunJobs(JobFunc jobFunc, void* pData, const int numJobs);
+
+#endif
@@ -0,0 +1,180 @@
+// ==================================================================
+// Filename:    tile.c
+// Description: implementation of the screen tiles binning
+// ==================================================================
+#include "tile.h"
+#include "array.h"
+#include "math_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+static Tile* s_Tiles      = NULL;
+static int   s_NumTilesX  = 0;
+static int   s_NumTilesY  = 0;
+static int   s_ScreenWidth  = 0;
+static int   s_ScreenHeight = 0;
+
+///////////////////////////////////////////////////////////
+
+void InitTiles(const int screenWidth, const int screenHeight)
+{
+    // split the screen into tiles; tiles on the right and
+    // bottom sides can be smaller than TILE_SIZE
+
+    assert((screenWidth > 0) && (screenHeight > 0) && "invalid input args");
+
+    s_ScreenWidth  = screenWidth;
+    s_ScreenHeight = screenHeight;
+    s_NumTilesX    = (screenWidth  + TILE_SIZE - 1) / TILE_SIZE;
+    s_NumTilesY    = (screenHeight + TILE_SIZE - 1) / TILE_SIZE;
+
+    s_Tiles = (Tile*)malloc(sizeof(Tile) * s_NumTilesX * s_NumTilesY);
+
+    for (int ty = 0; ty < s_NumTilesY; ++ty)
+    {
+        for (int tx = 0; tx < s_NumTilesX; ++tx)
+        {
+            Tile* pTile = &s_Tiles[ty * s_NumTilesX + tx];
+
+            pTile->rect.minX = tx * TILE_SIZE;
+            pTile->rect.minY = ty * TILE_SIZE;
+            pTile->rect.maxX = MIN((tx + 1) * TILE_SIZE, screenWidth)  - 1;
+            pTile->rect.maxY = MIN((ty + 1) * TILE_SIZE, screenHeight) - 1;
+            pTile->triangleIdxs = NULL;
+            pTile->visTriangles = NULL;
+        }
+    }
+
+    printf("Tiles are initialized: %d x %d tiles\n", s_NumTilesX, s_NumTilesY);
+}
+
+///////////////////////////////////////////////////////////
+
+void FreeTiles(void)
+{
+    for (int i = 0; i < s_NumTilesX * s_NumTilesY; ++i)
+    {
+        if (s_Tiles[i].triangleIdxs)
+            ArrayFree((void**)&s_Tiles[i].triangleIdxs);
+
+        if (s_Tiles[i].visTriangles)
+            ArrayFree((void**)&s_Tiles[i].visTriangles);
+    }
+
+    free(s_Tiles);
+    s_Tiles     = NULL;
+    s_NumTilesX = 0;
+    s_NumTilesY = 0;
+}
+
+///////////////////////////////////////////////////////////
+
+static bool IsTriangleOverlapTile(const Vec2Int p[3], const int sign, const Rect* pRect)
+{
+    // a triangle doesn't overlap the tile if the tile is entirely on
+    // the negative side of any triangle edge; the edge function is linear
+    // so it's enough to test the tile corner where it is the biggest;
+    // points are in 28.4 format and the rasterizer samples pixel centers
+
+    for (int i = 0; i < 3; ++i)
+    {
+        const Vec2Int pFrom = p[(i + 1) % 3];
+        const Vec2Int pTo   = p[(i + 2) % 3];
+
+        // E(x,y) = a*(x - from.x) + b*(y - from.y)
+        const int64_t a = sign * (pFrom.y - pTo.y);
+        const int64_t b = sign * (pTo.x - pFrom.x);
+
+        const int x = (((a > 0) ? pRect->maxX : pRect->minX) << SUBPIXEL_BITS) + SUBPIXEL_HALF;
+        const int y = (((b > 0) ? pRect->maxY : pRect->minY) << SUBPIXEL_BITS) + SUBPIXEL_HALF;
+
+        if (a * (x - pFrom.x) + b * (y - pFrom.y) < 0)
+            return false;
+    }
+
+    return true;
+}
+
+///////////////////////////////////////////////////////////
+
+void BinTriangles(
+    const RenderQueue* pQueue,
+    const int* order)
+{
+    // put an idx of each triangle into each tile which is overlapped by
+    // the triangle's bounding box; triangles are binned in the given order
+    // (or in the input order if there is no one) so the order of drawing
+    // within a tile remains the same
+
+    const int numTiles = s_NumTilesX * s_NumTilesY;
+    const int numTriangles = pQueue->numTriangles;
+
+    // bins keep their memory from frame to frame
+    for (int i = 0; i < numTiles; ++i)
+        ArrayClear(s_Tiles[i].triangleIdxs);
+
+    for (int k = 0; k < numTriangles; ++k)
+    {
+        const int i = (order) ? order[k] : k;
+        const int32_t* x = pQueue->x + i * 3;
+        const int32_t* y = pQueue->y + i * 3;
+
+        // the same points (snapped to 28.4 fixed-point) as the rasterizer uses
+        const Vec2Int v[3] = { { x[0], y[0] }, { x[1], y[1] }, { x[2], y[2] } };
+
+        // pixels which centers can be covered by the triangle
+        const int minX = MAX(SubpixelToFirstPixel(MIN3(v[0].x, v[1].x, v[2].x)), 0);
+        const int minY = MAX(SubpixelToFirstPixel(MIN3(v[0].y, v[1].y, v[2].y)), 0);
+        const int maxX = MIN(SubpixelToLastPixel(MAX3(v[0].x, v[1].x, v[2].x)), s_ScreenWidth - 1);
+        const int maxY = MIN(SubpixelToLastPixel(MAX3(v[0].y, v[1].y, v[2].y)), s_ScreenHeight - 1);
+
+        // the triangle is off the screen or doesn't cover any pixel center
+        if ((minX > maxX) || (minY > maxY))
+            continue;
+
+        // doubled signed area: its sign makes the edge functions positive inside
+        const int64_t area = 
+            (int64_t)(v[2].x - v[1].x) * (v[0].y - v[1].y) - 
+            (int64_t)(v[2].y - v[1].y) * (v[0].x - v[1].x);
+
+        // the rasterizer skips degenerate triangles
+        if (area == 0)
+            continue;
+
+        const int sign = (area > 0) ? 1 : -1;
+
+        const int tileMinX = minX / TILE_SIZE;
+        const int tileMinY = minY / TILE_SIZE;
+        const int tileMaxX = maxX / TILE_SIZE;
+        const int tileMaxY = maxY / TILE_SIZE;
+
+        for (int ty = tileMinY; ty <= tileMaxY; ++ty)
+        {
+            for (int tx = tileMinX; tx <= tileMaxX; ++tx)
+            {
+                Tile* pTile = &s_Tiles[ty * s_NumTilesX + tx];
+
+                if (IsTriangleOverlapTile(v, sign, &pTile->rect))
+                    ArrayPush(pTile->triangleIdxs, i);
+            }
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////
+
+int GetNumTiles(void)
+{
+    return s_NumTilesX * s_NumTilesY;
+}
+
+///////////////////////////////////////////////////////////
+
+Tile* GetTileByIdx(const int tileIdx)
+{
+    if (tileIdx < 0 || tileIdx >= s_NumTilesX * s_NumTilesY)
+        return NULL;
+
+    return &s_Tiles[tileIdx];
+}
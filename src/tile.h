@@ -0,0 +1,42 @@
+// ==================================================================
+// Filename:    tile.h
+// Description: tile-based rasterization stage:
+//              the screen is split into fixed-size tiles and each
+//              projected triangle is binned into all the tiles which
+//              its bounding box overlaps; then the triangles are
+//              rasterized tile by tile, so the color and depth
+//              working set of one tile stays in the cache
+// ==================================================================
+#ifndef TILE_H
+#define TILE_H
+
+#include "display.h"
+#include "triangle.h"
+
+#define TILE_SIZE 64      // width and height of a tile in pixels
+
+// each Hi-Z block must belong to a single tile so tiles
+// can be rendered in parallel without locks
+#if (TILE_SIZE % HIZ_BLOCK_SIZE) != 0
+#error "TILE_SIZE must be a multiple of HIZ_BLOCK_SIZE"
+#endif
+
+typedef struct
+{
+    Rect rect;            // screen area of the tile
+    int* triangleIdxs;    // dynamic arr of idxs of triangles which overlap the tile
+    VisibilityTriangle* visTriangles;  // dynamic arr: the triangles of the visibility buffer mode
+} Tile;
+
+
+void InitTiles(const int screenWidth, const int screenHeight);
+void FreeTiles(void);
+
+void BinTriangles(
+    const RenderQueue* pQueue,
+    const int* order);            // idxs of the triangles in the order of drawing (or NULL)
+
+int   GetNumTiles(void);
+Tile* GetTileByIdx(const int tileIdx);
+
+#endif
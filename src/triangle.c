@@ -9,6 +9,10 @@
 #include "array.h"
 #include "swap.h"
 #include "light.h"
+#include "math_common.h"
+#include "simd.h"
+#include <string.h>
+#include <assert.h>
 
 
 Vec3 GetTriangleNormal(const Vec4 v0, const Vec4 v1, const Vec4 v2)
@@ -34,104 +38,390 @@ Vec3 GetTriangleNormal(const Vec4 v0, const Vec4 v1, const Vec4 v2)
 }
 
 
+
+///////////////////////////////////////////////////////////
+
+void SwapTexCoords(Tex2* pTex1, Tex2* pTex2)
+{
+    Tex2 temp = *pTex1;
+    *pTex1 = *pTex2;
+    *pTex2 = temp;
+}
+
+///////////////////////////////////////////////////////////
+
+static inline int64_t EdgeFunction(const Vec2Int p, const Vec2Int q, const Vec2Int r)
+{
+    // doubled signed area of triangle PQR (the cross product of PQ and PR);
+    // it is positive if R is on the left side of the edge P->Q;
+    // the points are in 28.4 format so the product has 8 fractional bits
+    return (int64_t)(q.x - p.x) * (r.y - p.y) - (int64_t)(q.y - p.y) * (r.x - p.x);
+}
+
+///////////////////////////////////////////////////////////
+
+static inline bool IsTopLeftEdge(const int dx, const int dy)
+{
+    // (dx, dy) are increments of the edge function along x and y;
+    // a left edge grows to the right (the triangle is on its right side),
+    // a top edge is horizontal and grows downwards (the triangle is below it)
+    return (dx > 0) || ((dx == 0) && (dy > 0));
+}
+
+///////////////////////////////////////////////////////////
+
+static inline void StepInterpolants(Interpolants* pValue, const Interpolants* pStep)
+{
+    // move interpolated values by one pixel (or one row) using only additions
+    pValue->edge[0] += pStep->edge[0];
+    pValue->edge[1] += pStep->edge[1];
+    pValue->edge[2] += pStep->edge[2];
+    pValue->recipW  += pStep->recipW;
+    pValue->uOverW  += pStep->uOverW;
+    pValue->vOverW  += pStep->vOverW;
+}
+
+///////////////////////////////////////////////////////////
+
+static inline int FindRowSpan(
+    const TriangleSetup* pSetup,
+    const Interpolants* pRow,       // values at the left pixel of the bounding box row
+    Interpolants* pStart,           // out: values at the first pixel of the span
+    int* pEnd)                      // out: the last pixel of the span
+{
+    // find the span of the row which is inside the triangle and return
+    // its first pixel (if the row is empty the end is less than the start):
+    // 1. each edge growing to the right becomes >= 0 after ceil(-E / dx) pixels;
+    // 2. each edge falling to the right stays >= 0 for floor(E / -dx) pixels;
+    // 3. an edge which doesn't change along the row must be >= 0 already
+
+    const Interpolants* pDx = &pSetup->dx;
+    int64_t first = 0;
+    int64_t last  = pSetup->maxX - pSetup->minX;
+
+    for (int i = 0; i < 3; ++i)
+    {
+        const int64_t e  = pRow->edge[i];
+        const int64_t dx = pDx->edge[i];
+
+        if (dx > 0)
+        {
+            if (e < 0)
+                first = MAX(first, (dx - 1 - e) / dx);
+        }
+        else if (dx < 0)
+        {
+            last = (e < 0) ? -1 : MIN(last, e / -dx);
+        }
+        else if (e < 0)
+        {
+            last = -1;
+        }
+    }
+
+    *pStart = *pRow;
+
+    // the row doesn't cross the triangle
+    if (first > last)
+    {
+        *pEnd = pSetup->minX - 1;
+        return pSetup->minX;
+    }
+
+    if (first > 0)
+    {
+        pStart->edge[0] += first * pDx->edge[0];
+        pStart->edge[1] += first * pDx->edge[1];
+        pStart->edge[2] += first * pDx->edge[2];
+        pStart->recipW  += first * pDx->recipW;
+        pStart->uOverW  += first * pDx->uOverW;
+        pStart->vOverW  += first * pDx->vOverW;
+    }
+
+    *pEnd = pSetup->minX + (int)last;
+    return pSetup->minX + (int)first;
+}
+
+// ==================================================================
+// Hi-Z test of the blocks of one block row overlapped by the bounding
+// box of the triangle: a block is hidden if the nearest depth of the
+// triangle within the block isn't closer than the farthest depth which
+// is already in the block. Returns a mask of visible blocks (bit 0 is
+// the block of the bounding box left side)
+// ==================================================================
+#define HIZ_ALL_VISIBLE    (~(uint64_t)0)
+#define HIZ_DEPTH_EPSILON  1e-5f    // covers rounding of the per-pixel depth
+
+static uint64_t GetVisibleBlocks(const TriangleSetup* pSetup, const int blockY)
+{
+    const int minBlockX = pSetup->minX >> HIZ_BLOCK_SHIFT;
+    const int maxBlockX = pSetup->maxX >> HIZ_BLOCK_SHIFT;
+
+    // the mask is too small for the bounding box (it never happens
+    // for triangles which are clipped by a tile)
+    if (maxBlockX - minBlockX >= 64)
+        return HIZ_ALL_VISIBLE;
+
+    const Interpolants* pOrigin = &pSetup->origin;
+    const float stepX = pSetup->dx.recipW;
+    const float stepY = pSetup->dy.recipW;
+
+    // 1/w is linear so its max within a rectangle is in one of the corners:
+    // find the row of the block (inside the bounding box) where it is
+    const int minY = MAX(blockY << HIZ_BLOCK_SHIFT, pSetup->minY);
+    const int maxY = MIN(((blockY + 1) << HIZ_BLOCK_SHIFT) - 1, pSetup->maxY);
+    const int y    = (stepY > 0) ? maxY : minY;
+    const float rowRecipW = pOrigin->recipW + (float)(y - pSetup->minY) * stepY;
+
+    uint64_t visibleBlocks = 0;
+
+    for (int blockX = minBlockX; blockX <= maxBlockX; ++blockX)
+    {
+        const int minX = MAX(blockX << HIZ_BLOCK_SHIFT, pSetup->minX);
+        const int maxX = MIN(((blockX + 1) << HIZ_BLOCK_SHIFT) - 1, pSetup->maxX);
+        const int x    = (stepX > 0) ? maxX : minX;
+
+        // the triangle itself is never closer than its nearest vertex
+        const float maxRecipW = MIN(rowRecipW + (float)(x - pSetup->minX) * stepX, pSetup->maxRecipW);
+        const float minDepth  = 1.0f - maxRecipW;
+
+        if (!IsHiZBlockHidden(blockX, blockY, minDepth - HIZ_DEPTH_EPSILON))
+            visibleBlocks |= ((uint64_t)1 << (blockX - minBlockX));
+    }
+
+    return visibleBlocks;
+}
+
 ///////////////////////////////////////////////////////////
 
-void ComputeReciprocalW(
-    float* w0,               // w-component of point A
-    float* w1,               // ... of point B
-    float* w2)               // ... of point C
+static inline bool FindVisibleRun(
+    const TriangleSetup* pSetup,
+    const uint64_t visibleBlocks,
+    const int xEnd,             // the last pixel of the span
+    int* pX,                    // in: where to search from, out: where to continue
+    int* pRunStart,             // out: the first pixel of the run
+    int* pRunEnd)               // out: the last pixel of the run
 {
-    // compute and write back reciprocal W for each input point:
-    // (using this we will perform perspective division)
-    *w0 = 1.0f / *w0;
-    *w1 = 1.0f / *w1;
-    *w2 = 1.0f / *w2;
+    // find the next run of pixels of the span which are in visible blocks
+    int x = *pX;
+
+    if (x > xEnd)
+        return false;
+
+    if (visibleBlocks == HIZ_ALL_VISIBLE)
+    {
+        *pRunStart = x;
+        *pRunEnd   = xEnd;
+        *pX        = xEnd + 1;
+        return true;
+    }
+
+    const int minBlockX = pSetup->minX >> HIZ_BLOCK_SHIFT;
+
+    // skip hidden blocks
+    while ((x <= xEnd) && !((visibleBlocks >> ((x >> HIZ_BLOCK_SHIFT) - minBlockX)) & 1))
+        x = (x | HIZ_BLOCK_MASK) + 1;
+
+    if (x > xEnd)
+        return false;
+
+    *pRunStart = x;
+
+    // go through visible blocks
+    while ((x <= xEnd) && ((visibleBlocks >> ((x >> HIZ_BLOCK_SHIFT) - minBlockX)) & 1))
+        x = (x | HIZ_BLOCK_MASK) + 1;
+
+    *pRunEnd = MIN(x - 1, xEnd);
+    *pX      = x;
+    return true;
 }
 
 // ==================================================================
-// Return the barycentric weights alpha, beta, and gamma
-// for point p in the triangle ABC
+// Setup the half-space rasterization of a triangle:
+// the triangle is the intersection of three half-planes, each of them
+// is defined by the edge function of one edge:
+//
+//     E(x,y) = (Q.x - P.x) * (y - P.y) - (Q.y - P.y) * (x - P.x)
+//
+// E is linear, so stepping by one pixel to the right just adds (P.y - Q.y)
+// and stepping by one row down adds (Q.x - P.x). The edge functions
+// divided by the doubled area are the barycentric weights of the pixel,
+// so 1/w, u/w and v/w are linear as well and are stepped the same way.
+//
+// The points are in 28.4 fixed-point format and the edge functions are
+// exact integers sampled at pixel centers. A pixel center which lies
+// exactly on an edge belongs to the triangle only if it is a top or left
+// edge (the top-left fill rule), so a pixel on an edge shared by two
+// triangles is drawn only once.
 // ==================================================================
 /*
-              B
-             /|\
-            / | \
-           /  |  \
-          /  (p)  \
-         /  _/ \_  \
-        / _/     \_ \
-       /_/         \_\
-      A---------------C
+                 P1
+                 /\
+       edge2    /  \    edge0
+      (P0->P1) /    \  (P1->P2)
+              /  (p) \
+             /        \
+           P0----------P2
+              edge1 (P2->P0)
 */
 // ==================================================================
-void BarycentricWeights(
-    const Vec2Int a,      // point A
-    const Vec2Int b,      // point B
-    const Vec2Int c,      // point C
-    const Vec2Int p,      // point P
-    const Vec2Int ac,     
-    const float invArea,  // inverse area of doubled triangle                          
-    float* alpha,
-    float* beta,
-    float* gamma)
+static bool SetupTriangle(
+    Vec2Int p[3],               // screen points of the triangle (28.4 format)
+    float recipW[3],            // 1/w of the points
+    Tex2 tex[3],                // texture coords of the points
+    const Rect* pClipRect,      // rasterize only inside this rectangle
+    TriangleSetup* pSetup)
 {
-    // find the vectors between the vertices ABC and point p
-    const Vec2Int pc = {c.x - p.x, c.y - p.y}; // Vec2Sub(c, p);
-    const Vec2Int pb = {b.x - p.x, b.y - p.y}; // Vec2Sub(b, p);
-    const Vec2Int ap = {p.x - a.x, p.y - a.y}; // Vec2Sub(p, a);
+    int64_t area = EdgeFunction(p[1], p[2], p[0]);
+
+    // skip degenerate triangles
+    if (area == 0)
+        return false;
 
-    // alpha = area of parallelogram-PBC over the area of the full parallelogram-ABC
-    *alpha = (pc.x * pb.y - pc.y * pb.x) * invArea;
+    // make the winding consistent so the edge functions are positive inside
+    if (area < 0)
+    {
+        SWAPI(p[1].x, p[2].x);
+        SWAPI(p[1].y, p[2].y);
+        SWAPF(&recipW[1], &recipW[2]);
+        SwapTexCoords(&tex[1], &tex[2]);
+        area = -area;
+    }
+
+    // compute the bounding box of pixels which centers can be inside
+    // the triangle and clamp it to the clip rect
+    int minX = SubpixelToFirstPixel(MIN3(p[0].x, p[1].x, p[2].x));
+    int minY = SubpixelToFirstPixel(MIN3(p[0].y, p[1].y, p[2].y));
+    int maxX = SubpixelToLastPixel(MAX3(p[0].x, p[1].x, p[2].x));
+    int maxY = SubpixelToLastPixel(MAX3(p[0].y, p[1].y, p[2].y));
+
+    minX = MAX(minX, pClipRect->minX);
+    minY = MAX(minY, pClipRect->minY);
+    maxX = MIN(maxX, pClipRect->maxX);
+    maxY = MIN(maxY, pClipRect->maxY);
+
+    if ((minX > maxX) || (minY > maxY))
+        return false;
+
+    pSetup->minX = minX;
+    pSetup->minY = minY;
+    pSetup->maxX = maxX;
+    pSetup->maxY = maxY;
+
+    // edge functions at the center of the top-left pixel of the bounding box
+    // and their steps (one pixel is SUBPIXEL_ONE units in 28.4 format)
+    const Vec2Int origin =
+    {
+        (minX << SUBPIXEL_BITS) + SUBPIXEL_HALF,
+        (minY << SUBPIXEL_BITS) + SUBPIXEL_HALF
+    };
 
-    // beta = area of parallelogram-APC over the area of the full parallelogram-ABC
-    *beta = (ac.x * ap.y - ac.y * ap.x) * invArea;
+    for (int i = 0; i < 3; ++i)
+    {
+        const Vec2Int pFrom = p[(i + 1) % 3];
+        const Vec2Int pTo   = p[(i + 2) % 3];
+
+        pSetup->origin.edge[i] = EdgeFunction(pFrom, pTo, origin);
+        pSetup->dx.edge[i]     = (int64_t)(pFrom.y - pTo.y) * SUBPIXEL_ONE;
+        pSetup->dy.edge[i]     = (int64_t)(pTo.x - pFrom.x) * SUBPIXEL_ONE;
+    }
 
-    // gamma can be easily found since barycentric coordinated always add up to 1.0
-    *gamma = 1.0f - *alpha - *beta;
+    // interpolate 1/w, u/w and v/w using barycentric weights (edge / area)
+    const float invArea = 1.0f / (float)area;
+
+    pSetup->maxRecipW = MAX3(recipW[0], recipW[1], recipW[2]);
+    const float uOverW[3] = { tex[0].u * recipW[0], tex[1].u * recipW[1], tex[2].u * recipW[2] };
+    const float vOverW[3] = { tex[0].v * recipW[0], tex[1].v * recipW[1], tex[2].v * recipW[2] };
+
+    Interpolants* values[3] = { &pSetup->origin, &pSetup->dx, &pSetup->dy };
+
+    for (int i = 0; i < 3; ++i)
+    {
+        const float e0 = values[i]->edge[0] * invArea;
+        const float e1 = values[i]->edge[1] * invArea;
+        const float e2 = values[i]->edge[2] * invArea;
+
+        values[i]->recipW = (e0 * recipW[0]) + (e1 * recipW[1]) + (e2 * recipW[2]);
+        values[i]->uOverW = (e0 * uOverW[0]) + (e1 * uOverW[1]) + (e2 * uOverW[2]);
+        values[i]->vOverW = (e0 * vOverW[0]) + (e1 * vOverW[1]) + (e2 * vOverW[2]);
+    }
+
+    // top-left fill rule: the edge functions are exact integers, so shift
+    // them by one for the edges which don't own their pixels; after that
+    // "inside" is still tested as E >= 0
+    for (int i = 0; i < 3; ++i)
+    {
+        const Vec2Int pFrom = p[(i + 1) % 3];
+        const Vec2Int pTo   = p[(i + 2) % 3];
+
+        if (!IsTopLeftEdge(pFrom.y - pTo.y, pTo.x - pFrom.x))
+            pSetup->origin.edge[i] -= 1;
+    }
+
+    return true;
 }
 
 ///////////////////////////////////////////////////////////
 
-void DrawDepthLine(
-   const Vec2Int a,
-   const Vec2Int b,
-   const Vec2Int c,
-   const Vec2Int ac,
-   const float invArea,
-   const float w0, 
-   const float w1, 
-   const float w2,
-   const float lightIntensity,
-   const int xStart,
-   const int xEnd,
-   const int y,
-   const uint32_t color)
-{
-    float alpha = 0.0f;
-    float beta = 0.0f;
-    float gamma = 0.0f;
+static bool SetupQueuedTriangle(
+    const RenderQueue* pQueue,
+    const int triangleIdx,
+    const Rect* pClipRect,
+    TriangleSetup* pSetup)
+{
+    // gather the vertices of the triangle from the streams of the render queue
+    // (they are already snapped to 28.4 format) and set it up for rasterization
+    const int k = triangleIdx * 3;
 
+    Vec2Int p[3] =
+    {
+        { pQueue->x[k + 0], pQueue->y[k + 0] },
+        { pQueue->x[k + 1], pQueue->y[k + 1] },
+        { pQueue->x[k + 2], pQueue->y[k + 2] }
+    };
+    float recipW[3] = { pQueue->recipW[k + 0], pQueue->recipW[k + 1], pQueue->recipW[k + 2] };
+    Tex2  tex[3] = 
+    {
+        { pQueue->u[k + 0], pQueue->v[k + 0] },
+        { pQueue->u[k + 1], pQueue->v[k + 1] },
+        { pQueue->u[k + 2], pQueue->v[k + 2] }
+    };
+
+    return SetupTriangle(p, recipW, tex, pClipRect, pSetup);
+}
+
+///////////////////////////////////////////////////////////
+
+void DrawDepthLine(
+    Interpolants value,         // interpolated values at the pixel (xStart, y)
+    const Interpolants* pStep,
+    const float lightIntensity,
+    const int xStart,           // the start of the span
+    const int xFirst,           // draw the pixels [xFirst, xLast] of the span
+    const int xLast,
+    const int y,
+    const uint32_t color,
+    const bool isDepthTest)     // false for the painter's algorithm: draw each pixel without the z-buffer
+{
     // compute index of the pixel into z-buffer
-    int pixelIdx = GetWindowWidth() * y + xStart;
+    int pixelIdx = GetWindowWidth() * y + xFirst;
 
-    // go through each pixel in horizontal line
-    for (int x = xStart; x < xEnd; x++, pixelIdx++)
+    if (!isDepthTest)
     {
-        const Vec2Int p = { x, y };
-        BarycentricWeights(a, b, c, p, ac, invArea, &alpha, &beta, &gamma);
+        const uint32_t pixelColor = LightApplyIntensity(color, lightIntensity);
 
-        // multiply reciprocal W of each point by alpha/beta/gamma
-        const float alphaMulRecipW = (w0 * alpha);
-        const float betaMulRecipW  = (w1 * beta);
-        const float gammaMulRecipW = (w2 * gamma);
+        for (int x = xFirst; x <= xLast; x++, pixelIdx++)
+            DrawPixelByIdx(pixelIdx, pixelColor);
 
-        // also interpolate the value of 1/w for the current pixel
-        float interpolatedReciprocalW = alphaMulRecipW + betaMulRecipW + gammaMulRecipW;
+        return;
+    }
 
-        const float depth = 1.0f - interpolatedReciprocalW;
+    // go through each pixel in horizontal line
+    for (int x = xFirst; x <= xLast; x++, pixelIdx++)
+    {
+        // NOTE: (1.0f - 1/w): adjust 1/w so the pixels that are closer to the camera have smaller values
+        const float depth = 1.0f - (value.recipW + (float)(x - xStart) * pStep->recipW);
 
-        // immediately test if the pixel is closer or farther from the camera so we will be able to skip unnecessary computations (in case if farther)
-        // NOTE: (1.0f - interpolated_recip_w): adjust 1/w so the pixels that are closer to the camera have smaller values (because bigger w gives us smaller 1/w so we failing z-test)    
         if (depth < GetZBufferByPixelIdx(pixelIdx))
         {
             // update the z-buffer value with the 1/w of this current pixel
@@ -144,398 +434,1148 @@ void DrawDepthLine(
     }
 }
 
-
 // ==================================================================
-// Draw a filled triangle with the flat-top/flat-bottom method.
-// We split the original triangle in two, half flat-bottom and
-// half flat-top
-//===================================================================
-/*
-          (x0,y0)
-            / \
-           /   \
-          /     \
-         /       \
-        /         \
-   (x1,y1)------(Mx,My)
-       \_           \
-          \_         \
-             \_       \
-                \_     \
-                   \    \
-                     \_  \
-                        \_\
-                           \
-                         (x2,y2)
-*/
-//===================================================================
+// Draw a filled triangle with the half-space method: walk over the
+// bounding box of the triangle and fill each pixel which center is
+// on the positive side of all the three edges
+// ==================================================================
 void DrawFilledTriangle(
-    int x0, int y0, float w0,
-    int x1, int y1, float w1,
-    int x2, int y2, float w2,
-    const float lightIntensity,
-    const uint32_t color)
+    const RenderQueue* pQueue,
+    const int triangleIdx,
+    const Rect* pClipRect)
 {
-    // sort the vertices by Y-coordinate ascending (y0 < y1 < y2)
-    if (y0 > y1)
+    TriangleSetup setup;
+
+    if (!SetupQueuedTriangle(pQueue, triangleIdx, pClipRect, &setup))
+        return;
+
+    const float lightIntensity = pQueue->lightIntensity[triangleIdx];
+    const uint32_t color       = pQueue->color[triangleIdx];
+
+    // the painter's algorithm doesn't use the z-buffer (and so the Hi-Z)
+    const bool isDepthTest = !IsRenderFlag(RENDER_FLAG_PAINTER);
+    const bool isHiZ = isDepthTest && IsRenderFlag(RENDER_FLAG_HIZ);
+    uint64_t visibleBlocks = HIZ_ALL_VISIBLE;
+
+    Interpolants row = setup.origin;
+    Interpolants start;
+    int xEnd = 0;
+
+    for (int y = setup.minY; y <= setup.maxY; ++y, StepInterpolants(&row, &setup.dy))
     {
-        SWAPI(y0, y1);
-        SWAPI(x0, x1);
-        SWAPF(&w0, &w1);
+        // test the blocks of each next block row against the Hi-Z
+        if (isHiZ && ((y == setup.minY) || ((y & HIZ_BLOCK_MASK) == 0)))
+            visibleBlocks = GetVisibleBlocks(&setup, y >> HIZ_BLOCK_SHIFT);
+
+        // the whole block row is hidden
+        if (visibleBlocks == 0)
+            continue;
+
+        const int xStart = FindRowSpan(&setup, &row, &start, &xEnd);
+        int x = xStart;
+        int runStart = 0;
+        int runEnd = 0;
+
+        while (FindVisibleRun(&setup, visibleBlocks, xEnd, &x, &runStart, &runEnd))
+        {
+            // draw a colored line where each pixel has its own depth
+            DrawDepthLine(
+                start,
+                &setup.dx,
+                lightIntensity,
+                xStart,
+                runStart,
+                runEnd,
+                y,
+                color,
+                isDepthTest);
+
+            if (isHiZ)
+                MarkHiZBlocksDirty(y, runStart, runEnd);
+        }
     }
-    if (y1 > y2)
+}
+
+// ==================================================================
+// Render state bits which select a specialized textured span kernel:
+// the kernel is chosen once per triangle, and each kernel does only
+// the per-pixel work which its state needs
+// ==================================================================
+enum TexelKernelState
+{
+    KERNEL_SUBDIV     = (1 << 0),   // subdivided spans (the perspective divide every N pixels)
+    KERNEL_NO_DEPTH   = (1 << 1),   // no depth test and write (painter's algorithm, visibility buffer shading)
+    KERNEL_ALPHA_TEST = (1 << 2),   // the texture has transparent texels which are skipped
+    KERNEL_LIT        = (1 << 3),   // the light intensity changes the texel colors (it is less than 1)
+    KERNEL_POW2       = (1 << 4),   // the texture size is a power of two so the wrapping is a bit mask
+
+    KERNEL_NUM_STATES = (1 << 5)
+};
+
+// ==================================================================
+// Fetch the texel at the texture coords (u, v)
+// ==================================================================
+static inline uint32_t FetchTexel(
+    const float u,
+    const float v,
+    const int textureWidth,
+    const int textureHeight,
+    const uint32_t* textureBuffer)
+{
+    // map the UV coordinate to the full texture width and height
+    int tx = abs((int)(u * textureWidth))  % textureWidth;
+    int ty = abs((int)(v * textureHeight)) % textureHeight;
+
+    return textureBuffer[textureWidth * ty + tx];
+}
+
+///////////////////////////////////////////////////////////
+
+static inline uint32_t FetchTexelPow2(
+    const float u,
+    const float v,
+    const int textureWidth,
+    const int textureHeight,
+    const int widthShift,           // log2 of the texture width
+    const uint32_t* textureBuffer)
+{
+    // the same as FetchTexel but the texture size is a power of two
+    int tx = abs((int)(u * textureWidth))  & (textureWidth - 1);
+    int ty = abs((int)(v * textureHeight)) & (textureHeight - 1);
+
+    return textureBuffer[(ty << widthShift) + tx];
+}
+
+///////////////////////////////////////////////////////////
+
+static inline int GetTextureWidthShift(const int textureWidth)
+{
+    int widthShift = 0;
+
+    while ((1 << widthShift) < textureWidth)
+        widthShift++;
+
+    return widthShift;
+}
+
+// ==================================================================
+// Compute the perspective-correct texture coords of the pixel
+// (xStart + offset) of the span which starts at xStart
+// ==================================================================
+static inline void ComputeTexCoords(
+    const Interpolants* pValue,     // interpolated values at the span start
+    const Interpolants* pStep,
+    const float offset,
+    float* pU,
+    float* pV)
+{
+    // divide back both interpolated u/w and v/w by 1/w
+    const float recipW    = pValue->recipW + offset * pStep->recipW;
+    const float invRecipW = 1.0f / recipW;
+
+    *pU = (pValue->uOverW + offset * pStep->uOverW) * invRecipW;
+    *pV = (pValue->vOverW + offset * pStep->vOverW) * invRecipW;
+}
+
+// ==================================================================
+// Subdivided spans: u and v are exact at the ends of each segment of
+// N pixels and are interpolated affinely between them (Quake-style),
+// so there are only one or two divides per N pixels instead of one
+// divide per pixel; segments are aligned to the span start, so
+// the scalar and SIMD kernels get the same segments
+// ==================================================================
+typedef struct
+{
+    int   xStart, xEnd;     // the segment (-1 if it isn't set up yet)
+    float u, v;             // texture coords at xStart
+    float uEnd, vEnd;       // texture coords at xEnd
+    float du, dv;           // their increments for one pixel
+} AffineSegment;
+
+// 1/length of a segment (segments are 16 pixels at most)
+static const float s_RecipSegmentLength[17] =
+{
+    0.0f,        1.0f / 1,  1.0f / 2,  1.0f / 3,  1.0f / 4,
+    1.0f / 5,    1.0f / 6,  1.0f / 7,  1.0f / 8,  1.0f / 9,
+    1.0f / 10,   1.0f / 11, 1.0f / 12, 1.0f / 13, 1.0f / 14,
+    1.0f / 15,   1.0f / 16
+};
+
+static inline void SetupAffineSegment(
+    const Interpolants* pValue,     // interpolated values at the span start
+    const Interpolants* pStep,
+    const int xStart,               // the span start
+    const int xEnd,                 // the last pixel of the span
+    const int segStart,             // the first pixel of the segment
+    const int subdivLength,
+    AffineSegment* pSeg)
+{
+    // the segment doesn't go past the end of the span where 1/w could
+    // get close to zero (outside of the triangle)
+    const int segEnd = MIN(segStart + subdivLength, xEnd);
+
+    // the end of the previous segment is the start of this one
+    if (pSeg->xEnd == segStart)
     {
-        SWAPI(y1, y2);
-        SWAPI(x1, x2);
-        SWAPF(&w1, &w2);
+        pSeg->u = pSeg->uEnd;
+        pSeg->v = pSeg->vEnd;
     }
-    if (y0 > y1)
+    else
     {
-        SWAPI(y0, y1);
-        SWAPI(x0, x1);
-        SWAPF(&w0, &w1);
+        ComputeTexCoords(pValue, pStep, (float)(segStart - xStart), &pSeg->u, &pSeg->v);
     }
 
-    ComputeReciprocalW(&w0, &w1, &w2);
-
-    const Vec2Int a = { x0, y0 };
-    const Vec2Int b = { x1, y1 };
-    const Vec2Int c = { x2, y2 };
+    ComputeTexCoords(pValue, pStep, (float)(segEnd - xStart), &pSeg->uEnd, &pSeg->vEnd);
 
-    // inverse area of full parallelogram (doubled triangle ABC) using the cross product
-    const Vec2Int ac = {c.x - a.x, c.y - a.y};
-    const Vec2Int ab = {b.x - a.x, b.y - a.y};
-    float invArea = 1.0f / (ac.x * ab.y - ac.y * ab.x);  // 1.0f / Cross(AC, AB)
+    const float invLength = s_RecipSegmentLength[segEnd - segStart];
 
-    // ----------------------------------------------------
-    // Render the upper part of the triangle (flat-bottom)
-    // ----------------------------------------------------
-    float invSlope1 = 0.0f;
-    float invSlope2 = 0.0f;
+    pSeg->xStart = segStart;
+    pSeg->xEnd   = segEnd;
+    pSeg->du     = (pSeg->uEnd - pSeg->u) * invLength;
+    pSeg->dv     = (pSeg->vEnd - pSeg->v) * invLength;
+}
 
-    
-    if (y1 - y0 != 0)
+// ==================================================================
+// Compute the texture coords of the pixel x of the span [xStart, xEnd]:
+// exact if subdivLength is 0, or affine within the segment otherwise
+// (the segment is set up when the pixel goes into the next one)
+// ==================================================================
+static inline void GetTexelCoords(
+    const Interpolants* pValue,     // interpolated values at the span start
+    const Interpolants* pStep,
+    const int xStart,
+    const int xEnd,
+    const int x,
+    const int subdivLength,
+    AffineSegment* pSeg,
+    float* pU,
+    float* pV)
+{
+    if (subdivLength == 0)
     {
-        invSlope1 = (float)(x1 - x0) / abs(y1 - y0);
+        ComputeTexCoords(pValue, pStep, (float)(x - xStart), pU, pV);
+        return;
+    }
 
-        if (y2 - y0 != 0)
-            invSlope2 = (float)(x2 - x0) / abs(y2 - y0);
+    const int segStart = x - ((x - xStart) & (subdivLength - 1));
 
-        for (int y = y0; y < y1; y++)
-        {
-            int xStart = x1 + (y - y1) * invSlope1;
-            int xEnd   = x0 + (y - y0) * invSlope2;
+    if (pSeg->xStart != segStart)
+        SetupAffineSegment(pValue, pStep, xStart, xEnd, segStart, subdivLength, pSeg);
 
-            // swap if xStart is to the right of xEnd
-            if (xEnd < xStart)
-                SWAPI(xStart, xEnd);
+    const float segOffset = (float)(x - segStart);
+    *pU = pSeg->u + segOffset * pSeg->du;
+    *pV = pSeg->v + segOffset * pSeg->dv;
+}
 
-            // draw a colored line where each pixel has its own depth
-            DrawDepthLine(
-               a, b, c,
-               ac,
-               invArea,
-               w0, w1, w2,
-               lightIntensity,
-               xStart,
-               xEnd,
-               y,
-               color);
-        }
-    }
+// ==================================================================
+// Draw the textured pixels [xFirst, xLast] of the span [xStart, xEnd];
+// the attributes of each pixel are computed as (start + offset * step),
+// so the SIMD kernel below which processes a few pixels at once gets
+// exactly the same values for each lane, and the pixels don't depend
+// on which part of the span is drawn; if subdivLength is 0 the
+// perspective divide is done for each pixel, otherwise once per
+// segment of subdivLength pixels. The state is a constant in each
+// kernel, so the tests of its bits are resolved at compile time
+// ==================================================================
+static inline void DrawTexelPixels(
+    const Interpolants* pValue,     // interpolated values at the span start
+    const Interpolants* pStep,
+    const float lightIntensity,
+    const int xStart,
+    const int xEnd,
+    const int xFirst,
+    const int xLast,
+    const int y,
+    const int textureWidth,
+    const int textureHeight,
+    const uint32_t* textureBuffer,
+    const int subdivLength,
+    const int state)                // a combination of TexelKernelState bits
+{
+    u32*   colorRow = GetColorBuffer() + GetWindowWidth() * y;
+    float* depthRow = GetZBuffer()     + GetWindowWidth() * y;
+
+    const int widthShift = (state & KERNEL_POW2) ? GetTextureWidthShift(textureWidth) : 0;
+
+    AffineSegment seg = { -1, -1, 0, 0, 0, 0, 0, 0 };
 
-    // ----------------------------------------------------
-    // Render the bottom part of the triangle (flat-top)
-    // ----------------------------------------------------
-   
-    if (y2 - y1 != 0)
+    // go through each pixel in horizontal line
+    for (int x = xFirst; x <= xLast; x++)
     {
-        invSlope1 = (float)(x2 - x1) / abs(y2 - y1);
+        const float offset = (float)(x - xStart);
+        const float recipW = pValue->recipW + offset * pStep->recipW;
 
-        if (y2 - y0 != 0) 
-            invSlope2 = (float)(x2 - x0) / abs(y2 - y0);
+        // immediately test if the pixel is closer or farther from the camera so we will be able to skip unnecessary computations (in case if farther)
+        // NOTE: (1.0f - 1/w): adjust 1/w so the pixels that are closer to the camera have smaller values (because bigger w gives us smaller 1/w so we failing z-test)    
+        const float depth = 1.0f - recipW;
 
-        for (int y = y1; y <= y2; y++)
-        {
-            int xStart = x1 + (y - y1) * invSlope1;
-            int xEnd   = x0 + (y - y0) * invSlope2;
+        if (!(state & KERNEL_NO_DEPTH) && (depth >= depthRow[x]))
+            continue;
 
-            // swap if xStart is to the right of xEnd:
-            if (xEnd < xStart)
-                SWAPI(xStart, xEnd);
+        float u, v;
+        GetTexelCoords(pValue, pStep, xStart, xEnd, x, subdivLength, &seg, &u, &v);
 
-            // draw a colored line where each pixel has its own depth
-            DrawDepthLine(
-               a, b, c,
-               ac,
-               invArea,
-               w0, w1, w2,
-               lightIntensity,
-               xStart,
-               xEnd,
-               y,
-               color);
-        }
+        const uint32_t texColor = (state & KERNEL_POW2) ?
+            FetchTexelPow2(u, v, textureWidth, textureHeight, widthShift, textureBuffer) :
+            FetchTexel(u, v, textureWidth, textureHeight, textureBuffer);
+
+        // alpha clipping
+        if ((state & KERNEL_ALPHA_TEST) && ((texColor & 0xFF000000) == 0))
+            continue;
+
+        // update the z-buffer value with the 1/w of this current pixel
+        if (!(state & KERNEL_NO_DEPTH))
+            depthRow[x] = depth;
+
+        // draw the pixel with the color from the mapped texture
+        colorRow[x] = (state & KERNEL_LIT) ? LightApplyIntensity(texColor, lightIntensity) : texColor;
     }
 }
 
-
 // ==================================================================
-// Function to draw the textured pixels at pos X and Y using interpolation
+// Function to draw the textured pixels of one row of the triangle
+// (it is the generic kernel which handles any texture and light)
 // ==================================================================
 void DrawTexelLine(
-    const Vec2Int a,   // point A
-    const Vec2Int b,   // point B
-    const Vec2Int c,   // point C
-    const Vec2Int ac,
-    const Tex2 texA,
-    const Tex2 texB,
-    const Tex2 texC,
-    const float invArea,
-    const float w0,
-    const float w1, 
-    const float w2,
+    Interpolants value,
+    const Interpolants* pStep,
     const float lightIntensity,
     const int xStart,
     const int xEnd,
+    const int xFirst,
+    const int xLast,
     const int y,
     const int textureWidth,
     const int textureHeight,
     const uint32_t* textureBuffer)
 {
-    float alpha = 0.0f;
-    float beta  = 0.0f;
-    float gamma = 0.0f;
-  
+    DrawTexelPixels(
+        &value,
+        pStep,
+        lightIntensity,
+        xStart,
+        xEnd,
+        xFirst,
+        xLast,
+        y,
+        textureWidth,
+        textureHeight,
+        textureBuffer,
+        0,
+        KERNEL_ALPHA_TEST | KERNEL_LIT);
+}
 
-    // compute index of the pixel into z-buffer
-    int pixelIdx = GetWindowWidth() * y + xStart;
+#if SIMD_ENABLED
+// ==================================================================
+// SIMD versions of GetTexelCoords and FetchTexel for the pixels
+// (x + lane) where x is (xStart + i)
+// ==================================================================
+static inline void GetTexelCoordsSimd(
+    const Interpolants* pValue,     // interpolated values at the span start
+    const Interpolants* pStep,
+    const int xStart,
+    const int xEnd,
+    const int i,
+    const SimdFloat offset,         // offsets of the lanes from the span start
+    const SimdFloat recipW,         // 1/w of the lanes
+    const int subdivLength,
+    AffineSegment* pSeg,
+    SimdFloat* pU,
+    SimdFloat* pV)
+{
+    const SimdFloat laneIdx = SimdLaneIdxF();
 
-    // go through each pixel in horizontal line
-    for (int x = xStart; x <= xEnd; x++, pixelIdx++)
+    if (subdivLength == 0)
     {
-        const Vec2Int p = { x, y };
-        BarycentricWeights(a, b, c, p, ac, invArea, &alpha, &beta, &gamma);
+        // perspective-correct u and v
+        const SimdFloat invRecipW = SimdDivF(SimdSetF(1.0f), recipW);
+        const SimdFloat uOverW = SimdAddF(SimdSetF(pValue->uOverW), SimdMulF(offset, SimdSetF(pStep->uOverW)));
+        const SimdFloat vOverW = SimdAddF(SimdSetF(pValue->vOverW), SimdMulF(offset, SimdSetF(pStep->vOverW)));
+        *pU = SimdMulF(uOverW, invRecipW);
+        *pV = SimdMulF(vOverW, invRecipW);
+        return;
+    }
 
-        // multiply reciprocal W of each point by alpha/beta/gamma
-        const float alphaMulRecipW = (w0 * alpha);
-        const float betaMulRecipW  = (w1 * beta);
-        const float gammaMulRecipW = (w2 * gamma);
+    // u and v are affine within the segment
+    const int x = xStart + i;
+    const int segStart = x - (i & (subdivLength - 1));
 
-        // also interpolate the value of 1/w for the current pixel
-        float interpolatedReciprocalW = alphaMulRecipW + betaMulRecipW + gammaMulRecipW;
+    if (pSeg->xStart != segStart)
+        SetupAffineSegment(pValue, pStep, xStart, xEnd, segStart, subdivLength, pSeg);
 
-        const float depth = 1.0f - interpolatedReciprocalW;
+    const SimdFloat segOffset = SimdAddF(SimdSetF((float)(x - segStart)), laneIdx);
+    *pU = SimdAddF(SimdSetF(pSeg->u), SimdMulF(segOffset, SimdSetF(pSeg->du)));
+    *pV = SimdAddF(SimdSetF(pSeg->v), SimdMulF(segOffset, SimdSetF(pSeg->dv)));
+}
 
-        // immediately test if the pixel is closer or farther from the camera so we will be able to skip unnecessary computations (in case if farther)
-        // NOTE: (1.0f - interpolated_recip_w): adjust 1/w so the pixels that are closer to the camera have smaller values (because bigger w gives us smaller 1/w so we failing z-test)    
-        if (depth < GetZBufferByPixelIdx(pixelIdx))
-        {
-            // interpolate u/w and v/w coords using barycentric weights and a factor of 1/w
-            float interpolatedU = (texA.u * alphaMulRecipW) + (texB.u * betaMulRecipW) + (texC.u * gammaMulRecipW);
-            float interpolatedV = (texA.v * alphaMulRecipW) + (texB.v * betaMulRecipW) + (texC.v * gammaMulRecipW);
+///////////////////////////////////////////////////////////
 
-            float invInterpolatedReciprocalW = 1.0f / interpolatedReciprocalW;
-            
-            // now we can divide back both interpolated values by 1/w
-            interpolatedU *= invInterpolatedReciprocalW;
-            interpolatedV *= invInterpolatedReciprocalW;
+static inline SimdInt FetchTexelsSimd(
+    const SimdFloat u,
+    const SimdFloat v,
+    const int textureWidth,
+    const int textureHeight,
+    const uint32_t* textureBuffer,
+    const bool isPow2Texture,       // if the texture size is a power of two the modulo is just a bit mask
+    const int widthShift)           // log2 of the texture width (for the power of two size)
+{
+    // map the UV coordinate to the texel and fetch it
+    SimdInt tx = SimdAbsI(SimdFloatToInt(SimdMulF(u, SimdSetF((float)textureWidth))));
+    SimdInt ty = SimdAbsI(SimdFloatToInt(SimdMulF(v, SimdSetF((float)textureHeight))));
 
-            // map the UV coordinate to the full texture width and height
-            int tx = abs((int)(interpolatedU * textureWidth))  % textureWidth;
-            int ty = abs((int)(interpolatedV * textureHeight)) % textureHeight;
+    if (isPow2Texture)
+    {
+        tx = SimdAndI(tx, SimdSetI(textureWidth - 1));
+        ty = SimdAndI(ty, SimdSetI(textureHeight - 1));
+        return SimdGatherI(textureBuffer, SimdAddI(SimdShiftLeftI(ty, widthShift), tx));
+    }
 
-            uint32_t texColor = textureBuffer[textureWidth * ty + tx];
+    // there is no SIMD integer modulo so fetch lane by lane
+    int32_t txs[SIMD_WIDTH];
+    int32_t tys[SIMD_WIDTH];
+    uint32_t texels[SIMD_WIDTH];
 
+    SimdStoreI(txs, tx);
+    SimdStoreI(tys, ty);
 
-            // alpha clipping
-            if (((texColor & 0xFF000000) >> 6) < 0.1f)
-            {
-                continue;
-            }
-            else
-            {
-                // update the z-buffer value with the 1/w of this current pixel
-                SetZBufferByPixelIdx(pixelIdx, depth);
+    for (int lane = 0; lane < SIMD_WIDTH; ++lane)
+        texels[lane] = textureBuffer[textureWidth * (tys[lane] % textureHeight) + (txs[lane] % textureWidth)];
 
-                const uint32_t pixelColor = LightApplyIntensity(texColor, lightIntensity);
+    return SimdLoadI(texels);
+}
 
-                // draw the pixel at pos (x,y) with the color from the mapped texture only if the depth value is less that the previous one stored in the z-buffer
-                DrawPixel(x, y, pixelColor);
+// ==================================================================
+// SIMD version of DrawTexelPixels: process SIMD_WIDTH pixels per iteration
+// (depth test, perspective divide, texel fetch and lighting are done
+// in vector registers, and the results are written under a lane mask);
+// the pixels which don't fill the whole vector go to the scalar kernel.
+// Every operation matches the scalar one so the output is pixel-identical.
+// Vectors are aligned to the span start and the subdivided segments are
+// multiples of SIMD_WIDTH, so a vector of pixels is always inside
+// a single segment; the lanes before xFirst are masked out
+// ==================================================================
+static inline void DrawTexelPixelsSimd(
+    const Interpolants* pValue,
+    const Interpolants* pStep,
+    float lightIntensity,
+    const int xStart,
+    const int xEnd,
+    const int xFirst,
+    const int xLast,
+    const int y,
+    const int textureWidth,
+    const int textureHeight,
+    const uint32_t* textureBuffer,
+    const int subdivLength,
+    const int state)                // a combination of TexelKernelState bits
+{
+    const int numPixels     = xLast - xStart + 1;
+    const int numSimdPixels = numPixels - (numPixels % SIMD_WIDTH);
+    const int firstOffset   = xFirst - xStart;
 
-            }
-            
-        } // if
-    } // for
+    u32*   colorRow = GetColorBuffer() + GetWindowWidth() * y;
+    float* depthRow = GetZBuffer()     + GetWindowWidth() * y;
+
+    const bool isDepthTest = !(state & KERNEL_NO_DEPTH);
+    const int widthShift   = (state & KERNEL_POW2) ? GetTextureWidthShift(textureWidth) : 0;
+
+    // clamp in range [0, 1] the same way as LightApplyIntensity does
+    lightIntensity = (lightIntensity < 0) ? 0 : lightIntensity;
+    lightIntensity = (lightIntensity > 1) ? 1 : lightIntensity;
+
+    const SimdFloat one         = SimdSetF(1.0f);
+    const SimdFloat laneIdx     = SimdLaneIdxF();
+    const SimdFloat light       = SimdSetF(lightIntensity);
+    const SimdInt   zero        = SimdSetI(0);
+    const SimdInt   alphaMask   = SimdSetI(0xFF000000);
+    const SimdInt   redMask     = SimdSetI(0x00FF0000);
+    const SimdInt   greenMask   = SimdSetI(0x0000FF00);
+    const SimdInt   blueMask    = SimdSetI(0x000000FF);
+
+    AffineSegment seg = { -1, -1, 0, 0, 0, 0, 0, 0 };
+
+    for (int i = firstOffset - (firstOffset % SIMD_WIDTH); i < numSimdPixels; i += SIMD_WIDTH)
+    {
+        const int x = xStart + i;
+        const SimdFloat offset = SimdAddF(SimdSetF((float)i), laneIdx);
+
+        // depth test for all the lanes at once
+        const SimdFloat recipW   = SimdAddF(SimdSetF(pValue->recipW), SimdMulF(offset, SimdSetF(pStep->recipW)));
+        const SimdFloat depth    = SimdSubF(one, recipW);
+        const SimdFloat oldDepth = (isDepthTest) ? SimdLoadF(depthRow + x) : one;
+        SimdInt writeMask        = (isDepthTest) ? SimdLessF(depth, oldDepth) : SimdSetI(-1);
+
+        if (i < firstOffset)
+            writeMask = SimdAndI(writeMask, SimdLessF(SimdSetF((float)firstOffset - 0.5f), offset));
+
+        if (SimdMoveMask(writeMask) == 0)
+            continue;
+
+        SimdFloat u, v;
+        GetTexelCoordsSimd(pValue, pStep, xStart, xEnd, i, offset, recipW, subdivLength, &seg, &u, &v);
+
+        const SimdInt texColor = FetchTexelsSimd(
+            u, v,
+            textureWidth,
+            textureHeight,
+            textureBuffer,
+            (state & KERNEL_POW2) != 0,
+            widthShift);
+
+        // alpha clipping: skip fully transparent texels
+        if (state & KERNEL_ALPHA_TEST)
+            writeMask = SimdAndNotI(SimdEqualI(SimdAndI(texColor, alphaMask), zero), writeMask);
+
+        SimdInt pixelColor = texColor;
+
+        // apply light intensity to each color channel
+        if (state & KERNEL_LIT)
+        {
+            const SimdInt a = SimdAndI(texColor, alphaMask);
+            const SimdInt r = SimdFloatToInt(SimdMulF(SimdIntToFloat(SimdAndI(texColor, redMask)),   light));
+            const SimdInt g = SimdFloatToInt(SimdMulF(SimdIntToFloat(SimdAndI(texColor, greenMask)), light));
+            const SimdInt b = SimdFloatToInt(SimdMulF(SimdIntToFloat(SimdAndI(texColor, blueMask)),  light));
+
+            pixelColor = SimdOrI(
+                SimdOrI(a, SimdAndI(r, redMask)),
+                SimdOrI(SimdAndI(g, greenMask), SimdAndI(b, blueMask)));
+        }
+
+        // write only the lanes which passed the depth and alpha tests
+        if (isDepthTest)
+            SimdStoreF(depthRow + x, SimdSelectF(writeMask, depth, oldDepth));
+        SimdStoreI(colorRow + x, SimdSelectI(writeMask, pixelColor, SimdLoadI(colorRow + x)));
+    }
+
+    // the rest pixels of the line
+    DrawTexelPixels(
+        pValue,
+        pStep,
+        lightIntensity,
+        xStart,
+        xEnd,
+        MAX(xFirst, xStart + numSimdPixels),
+        xLast,
+        y,
+        textureWidth,
+        textureHeight,
+        textureBuffer,
+        subdivLength,
+        state);
 }
 
+#endif
+
 // ==================================================================
-// Draw a texture triangle with the flat-top/flat-bottom method
-// We split the original triangle in two, half flat-bottom
-// and half flat-top
+// Specialized kernels: one scalar and one SIMD kernel for each
+// combination of the TexelKernelState bits (the state is passed as
+// a constant, so each inlined copy of DrawTexelPixels(Simd) contains
+// only the work which the state needs)
 // ==================================================================
-/*
-         A(x0,y0)
-            / \
-           /   \
-          /     \
-         /       \
-        /         \
-  B(x1,y1)         \
-       \_           \
-          \_         \
-             \_       \
-                \_     \
-                   \    \
-                     \_  \
-                        \_\
-                           \
-                        C(x2,y2)
-*/
-//===================================================================
+#define TEXEL_KERNEL_STATES(X)                                          \
+    X(0)  X(1)  X(2)  X(3)  X(4)  X(5)  X(6)  X(7)                      \
+    X(8)  X(9)  X(10) X(11) X(12) X(13) X(14) X(15)                     \
+    X(16) X(17) X(18) X(19) X(20) X(21) X(22) X(23)                     \
+    X(24) X(25) X(26) X(27) X(28) X(29) X(30) X(31)
+
+#define DEFINE_TEXEL_LINE_FUNC(name, drawTexelPixels, state)            \
+    static void name(                                                   \
+        Interpolants value,                                             \
+        const Interpolants* pStep,                                      \
+        const float lightIntensity,                                     \
+        const int xStart,                                               \
+        const int xEnd,                                                 \
+        const int xFirst,                                               \
+        const int xLast,                                                \
+        const int y,                                                    \
+        const int textureWidth,                                         \
+        const int textureHeight,                                        \
+        const uint32_t* textureBuffer)                                  \
+    {                                                                   \
+        drawTexelPixels(                                                \
+            &value,                                                     \
+            pStep,                                                      \
+            lightIntensity,                                             \
+            xStart,                                                     \
+            xEnd,                                                       \
+            xFirst,                                                     \
+            xLast,                                                      \
+            y,                                                          \
+            textureWidth,                                               \
+            textureHeight,                                              \
+            textureBuffer,                                              \
+            ((state) & KERNEL_SUBDIV) ? GetSubdivSpanLength() : 0,      \
+            (state));                                                   \
+    }
 
-void SwapTexCoords(Tex2* pTex1, Tex2* pTex2)
+#define DEFINE_TEXEL_LINE_SCALAR(state) \
+    DEFINE_TEXEL_LINE_FUNC(DrawTexelLineScalar##state, DrawTexelPixels, state)
+#define TEXEL_LINE_SCALAR_ENTRY(state)  DrawTexelLineScalar##state,
+
+TEXEL_KERNEL_STATES(DEFINE_TEXEL_LINE_SCALAR)
+
+// the kernels indexed by their state
+static const TexelLineFunc s_TexelLineFuncs[KERNEL_NUM_STATES] =
 {
-    Tex2 temp = *pTex1;
-    *pTex1 = *pTex2;
-    *pTex2 = temp;
+    TEXEL_KERNEL_STATES(TEXEL_LINE_SCALAR_ENTRY)
+};
+
+#if SIMD_ENABLED
+#define DEFINE_TEXEL_LINE_SIMD(state) \
+    DEFINE_TEXEL_LINE_FUNC(DrawTexelLineSimd##state, DrawTexelPixelsSimd, state)
+#define TEXEL_LINE_SIMD_ENTRY(state)  DrawTexelLineSimd##state,
+
+TEXEL_KERNEL_STATES(DEFINE_TEXEL_LINE_SIMD)
+
+static const TexelLineFunc s_TexelLineFuncsSimd[KERNEL_NUM_STATES] =
+{
+    TEXEL_KERNEL_STATES(TEXEL_LINE_SIMD_ENTRY)
+};
+#endif
+
+///////////////////////////////////////////////////////////
+
+static int GetTexelKernelState(
+    const bool isDepthTest,
+    const bool isTextureOpaque,
+    const float lightIntensity,
+    const int textureWidth,
+    const int textureHeight)
+{
+    int state = 0;
+
+    if (IsRenderFlag(RENDER_FLAG_SUBDIV_SPANS))
+        state |= KERNEL_SUBDIV;
+
+    if (!isDepthTest)
+        state |= KERNEL_NO_DEPTH;
+
+    if (!isTextureOpaque)
+        state |= KERNEL_ALPHA_TEST;
+
+    // LightApplyIntensity clamps the intensity to [0, 1]
+    // so the intensity of 1 or more keeps the texel colors
+    if (lightIntensity < 1.0f)
+        state |= KERNEL_LIT;
+
+    if (((textureWidth  & (textureWidth  - 1)) == 0) &&
+        ((textureHeight & (textureHeight - 1)) == 0))
+        state |= KERNEL_POW2;
+
+    return state;
 }
 
 ///////////////////////////////////////////////////////////
 
+static TexelLineFunc ChooseTexelLineFunc(const int state)
+{
+#if SIMD_ENABLED
+    if (IsRenderFlag(RENDER_FLAG_SIMD))
+        return s_TexelLineFuncsSimd[state];
+#endif
+
+    return s_TexelLineFuncs[state];
+}
+
+// ==================================================================
+// Draw a textured triangle with the half-space method: set up
+// the edge functions and the perspective-correct attributes once,
+// and then step them by additions over the bounding box rows
+// ==================================================================
 void DrawTexturedTriangle(
-    int x0, int y0, float z0, float w0,
-    int x1, int y1, float z1, float w1,
-    int x2, int y2, float z2, float w2,
-    float u0, float v0,
-    float u1, float v1,
-    float u2, float v2,
-    float lightIntensity,                                            
-    const upng_t* pTexture)
-{
-    Tex2 texA = { u0, v0 };
-    Tex2 texB = { u1, v1 };
-    Tex2 texC = { u2, v2 };
-
-    if (y0 > y1)
-    {
-        SWAPI(y0, y1);
-        SWAPI(x0, x1);
-        //SWAPF(&z0, &z1);
-        SWAPF(&w0, &w1);
-        SwapTexCoords(&texA, &texB);
-    }
-    if (y1 > y2)
-    {
-        SWAPI(y1, y2);
-        SWAPI(x1, x2);
-        //SWAPF(&z1, &z2);
-        SWAPF(&w1, &w2);
-        SwapTexCoords(&texB, &texC);
-    }
-    if (y0 > y1)
-    {
-        SWAPI(y0, y1);
-        SWAPI(x0, x1);
-        //SWAPF(&z0, &z1);
-        SWAPF(&w0, &w1);
-        SwapTexCoords(&texA, &texB);
-    }
+    const RenderQueue* pQueue,
+    const int triangleIdx,
+    const Rect* pClipRect)
+{
+    TriangleSetup setup;
 
-    ComputeReciprocalW(&w0, &w1, &w2);
-   
-    const Vec2Int a = { x0, y0 };
-    const Vec2Int b = { x1, y1 };
-    const Vec2Int c = { x2, y2 };
+    if (!SetupQueuedTriangle(pQueue, triangleIdx, pClipRect, &setup))
+        return;
 
-    // inverse area of the full parallelogram (doubled triangle ABC) using the cross product
-    const Vec2Int ac = {c.x - a.x, c.y - a.y};            
-    const Vec2Int ab = {b.x - a.x, b.y - a.y};            
-    float invArea = 1.0f / (ac.x * ab.y - ac.y * ab.x);   // 1.0f / Cross(AC, AB)
+    const Material* pMaterial   = pQueue->materials + pQueue->materialIdx[triangleIdx];
+    const upng_t* pTexture      = pMaterial->pTexture;
+    const bool isTextureOpaque  = pMaterial->isTextureOpaque;
+    const float lightIntensity  = pQueue->lightIntensity[triangleIdx];
 
     const int textureWidth        = upng_get_width(pTexture);
     const int textureHeight       = upng_get_height(pTexture); 
     const uint32_t* textureBuffer = (uint32_t*) upng_get_buffer(pTexture);
 
-    // ----------------------------------------------------
-    // Render the upper part of the triangle (flat-bottom)
-    // ----------------------------------------------------
-    float invSlope1 = 0.0f;
-    float invSlope2 = 0.0f;
+    // the painter's algorithm doesn't use the z-buffer (and so the Hi-Z)
+    const bool isDepthTest = !IsRenderFlag(RENDER_FLAG_PAINTER);
 
-    if (y1 - y0 != 0)
-    { 
-        invSlope1 = (float)(x1 - x0) / abs(y1 - y0);
+    // choose the span kernel for the render state of this triangle
+    const TexelLineFunc drawTexelLine = ChooseTexelLineFunc(GetTexelKernelState(
+        isDepthTest,
+        isTextureOpaque,
+        lightIntensity,
+        textureWidth,
+        textureHeight));
 
-        if (y2 - y0 != 0) 
-            invSlope2 = (float)(x2 - x0) / abs(y2 - y0);
+    const bool isHiZ = isDepthTest && IsRenderFlag(RENDER_FLAG_HIZ);
+    uint64_t visibleBlocks = HIZ_ALL_VISIBLE;
 
-        for (int y = y0; y < y1; y++)
-        {
-            int xStart = x1 + (y - y1) * invSlope1;
-            int xEnd   = x0 + (y - y0) * invSlope2;
+    Interpolants row = setup.origin;
+    Interpolants start;
+    int xEnd = 0;
+
+    for (int y = setup.minY; y <= setup.maxY; ++y, StepInterpolants(&row, &setup.dy))
+    {
+        // test the blocks of each next block row against the Hi-Z
+        if (isHiZ && ((y == setup.minY) || ((y & HIZ_BLOCK_MASK) == 0)))
+            visibleBlocks = GetVisibleBlocks(&setup, y >> HIZ_BLOCK_SHIFT);
 
-            // swap if xStart is to the right of xEnd
-            if (xEnd < xStart)
-                SWAPI(xStart, xEnd);
+        // the whole block row is hidden
+        if (visibleBlocks == 0)
+            continue;
 
+        const int xStart = FindRowSpan(&setup, &row, &start, &xEnd);
+        int x = xStart;
+        int runStart = 0;
+        int runEnd = 0;
+
+        while (FindVisibleRun(&setup, visibleBlocks, xEnd, &x, &runStart, &runEnd))
+        {
             // sample pixel color from the texture
-            DrawTexelLine(
-                a, b, c,
-                ac, 
-                texA,
-                texB,
-                texC,
-                invArea,
-                w0, w1, w2,
+            drawTexelLine(
+                start,
+                &setup.dx,
                 lightIntensity,
                 xStart,
                 xEnd,
+                runStart,
+                runEnd,
                 y,
                 textureWidth,
                 textureHeight,
                 textureBuffer);
+
+            if (isHiZ)
+                MarkHiZBlocksDirty(y, runStart, runEnd);
         }
     }
+}
 
-    // ----------------------------------------------------
-    // Render the bottom part of the triangle (flat-top)
-    // ----------------------------------------------------
-   
-    if (y2 - y1 != 0)
+// ==================================================================
+// Visibility buffer mode (deferred texturing): the depth pass writes
+// only the depth and the id of the nearest triangle into each pixel,
+// and then the shading pass textures each pixel exactly once, so the
+// cost of texture fetches and lighting is bounded by the number of
+// pixels whatever overdraw the scene has. Only triangles with
+// transparent texels fetch their texture in the depth pass (for
+// the alpha test).
+//
+// The shading pass walks the rows of each triangle down with the
+// same additions as DrawTexturedTriangle and draws the visible pixels
+// with the same span kernels, so the image is the same as in the
+// forward mode.
+// ==================================================================
+typedef void (*VisibilityPixelsFunc)(
+    const Interpolants* pValue,
+    const Interpolants* pStep,
+    const int xStart,
+    const int xEnd,
+    const int xFirst,
+    const int xLast,
+    const int y,
+    const uint32_t id,
+    const int textureWidth,
+    const int textureHeight,
+    const uint32_t* textureBuffer,
+    const int subdivLength);
+
+///////////////////////////////////////////////////////////
+
+static void DrawVisibilityPixels(
+    const Interpolants* pValue,     // interpolated values at the span start
+    const Interpolants* pStep,
+    const int xStart,
+    const int xEnd,
+    const int xFirst,
+    const int xLast,
+    const int y,
+    const uint32_t id,
+    const int textureWidth,
+    const int textureHeight,
+    const uint32_t* textureBuffer,  // NULL if the triangle doesn't need the alpha test
+    const int subdivLength)
+{
+    float*    depthRow = GetZBuffer()   + GetWindowWidth() * y;
+    uint32_t* idRow    = GetIdBuffer()  + GetWindowWidth() * y;
+
+    AffineSegment seg = { -1, -1, 0, 0, 0, 0, 0, 0 };
+
+    for (int x = xFirst; x <= xLast; ++x)
     {
-        invSlope2 = 0.0f;
-        invSlope1 = (float)(x2 - x1) / abs(y2 - y1);
+        const float recipW = pValue->recipW + (float)(x - xStart) * pStep->recipW;
+        const float depth  = 1.0f - recipW;
 
-        if (y2 - y0 != 0) 
-            invSlope2 = (float)(x2 - x0) / abs(y2 - y0);
+        if (depth >= depthRow[x])
+            continue;
 
-        for (int y = y1; y <= y2; y++)
+        // alpha clipping with the same texture coords as in the shading pass
+        if (textureBuffer)
         {
-            int xStart = x1 + (y - y1) * invSlope1;
-            int xEnd   = x0 + (y - y0) * invSlope2;
+            float u, v;
+            GetTexelCoords(pValue, pStep, xStart, xEnd, x, subdivLength, &seg, &u, &v);
 
-            // swap if xStart is to the right of xEnd:
-            if (xEnd < xStart)
-                SWAPI(xStart, xEnd);
+            if ((FetchTexel(u, v, textureWidth, textureHeight, textureBuffer) & 0xFF000000) == 0)
+                continue;
+        }
 
-            // sample pixel color from the texture
-            DrawTexelLine(
-                a, b, c,
-                ac, 
-                texA,
-                texB,
-                texC,
-                invArea,
-                w0, w1, w2,
-                lightIntensity,
+        depthRow[x] = depth;
+        idRow[x]    = id;
+    }
+}
+
+#if SIMD_ENABLED
+// ==================================================================
+// SIMD version of DrawVisibilityPixels: vectors are aligned to
+// the span start the same way as in DrawTexelPixelsSimd
+// ==================================================================
+static void DrawVisibilityPixelsSimd(
+    const Interpolants* pValue,
+    const Interpolants* pStep,
+    const int xStart,
+    const int xEnd,
+    const int xFirst,
+    const int xLast,
+    const int y,
+    const uint32_t id,
+    const int textureWidth,
+    const int textureHeight,
+    const uint32_t* textureBuffer,
+    const int subdivLength)
+{
+    const int numPixels     = xLast - xStart + 1;
+    const int numSimdPixels = numPixels - (numPixels % SIMD_WIDTH);
+    const int firstOffset   = xFirst - xStart;
+
+    float*    depthRow = GetZBuffer()  + GetWindowWidth() * y;
+    uint32_t* idRow    = GetIdBuffer() + GetWindowWidth() * y;
+
+    const bool isPow2Texture =
+        ((textureWidth  & (textureWidth  - 1)) == 0) &&
+        ((textureHeight & (textureHeight - 1)) == 0);
+
+    const int widthShift = GetTextureWidthShift(textureWidth);
+
+    const SimdFloat one       = SimdSetF(1.0f);
+    const SimdFloat laneIdx   = SimdLaneIdxF();
+    const SimdInt   ids       = SimdSetI((int)id);
+    const SimdInt   zero      = SimdSetI(0);
+    const SimdInt   alphaMask = SimdSetI(0xFF000000);
+
+    AffineSegment seg = { -1, -1, 0, 0, 0, 0, 0, 0 };
+
+    for (int i = firstOffset - (firstOffset % SIMD_WIDTH); i < numSimdPixels; i += SIMD_WIDTH)
+    {
+        const int x = xStart + i;
+        const SimdFloat offset = SimdAddF(SimdSetF((float)i), laneIdx);
+
+        const SimdFloat recipW   = SimdAddF(SimdSetF(pValue->recipW), SimdMulF(offset, SimdSetF(pStep->recipW)));
+        const SimdFloat depth    = SimdSubF(one, recipW);
+        const SimdFloat oldDepth = SimdLoadF(depthRow + x);
+        SimdInt writeMask        = SimdLessF(depth, oldDepth);
+
+        if (i < firstOffset)
+            writeMask = SimdAndI(writeMask, SimdLessF(SimdSetF((float)firstOffset - 0.5f), offset));
+
+        if (SimdMoveMask(writeMask) == 0)
+            continue;
+
+        // alpha clipping with the same texture coords as in the shading pass
+        if (textureBuffer)
+        {
+            SimdFloat u, v;
+            GetTexelCoordsSimd(pValue, pStep, xStart, xEnd, i, offset, recipW, subdivLength, &seg, &u, &v);
+
+            const SimdInt texColor = FetchTexelsSimd(
+                u, v,
+                textureWidth,
+                textureHeight,
+                textureBuffer,
+                isPow2Texture,
+                widthShift);
+
+            writeMask = SimdAndNotI(SimdEqualI(SimdAndI(texColor, alphaMask), zero), writeMask);
+        }
+
+        SimdStoreF(depthRow + x, SimdSelectF(writeMask, depth, oldDepth));
+        SimdStoreI(idRow + x, SimdSelectI(writeMask, ids, SimdLoadI(idRow + x)));
+    }
+
+    // the rest pixels of the line
+    DrawVisibilityPixels(
+        pValue,
+        pStep,
+        xStart,
+        xEnd,
+        MAX(xFirst, xStart + numSimdPixels),
+        xLast,
+        y,
+        id,
+        textureWidth,
+        textureHeight,
+        textureBuffer,
+        subdivLength);
+}
+#endif
+
+///////////////////////////////////////////////////////////
+
+bool DrawTriangleVisibility(
+    const RenderQueue* pQueue,
+    const int triangleIdx,
+    const uint32_t id,
+    const Rect* pClipRect,
+    VisibilityTriangle* pVisTriangle)
+{
+    TriangleSetup* pSetup = &pVisTriangle->setup;
+
+    if (!SetupQueuedTriangle(pQueue, triangleIdx, pClipRect, pSetup))
+        return false;
+
+    const Material* pMaterial = pQueue->materials + pQueue->materialIdx[triangleIdx];
+
+    pVisTriangle->row            = pSetup->origin;
+    pVisTriangle->rowY           = pSetup->minY;
+    pVisTriangle->spanY          = -1;
+    pVisTriangle->lightIntensity = pQueue->lightIntensity[triangleIdx];
+    pVisTriangle->textureWidth   = upng_get_width(pMaterial->pTexture);
+    pVisTriangle->textureHeight  = upng_get_height(pMaterial->pTexture);
+    pVisTriangle->textureBuffer  = (const uint32_t*)upng_get_buffer(pMaterial->pTexture);
+
+    // the shading pass draws only the pixels which were chosen in this pass
+    // so its kernel needs neither the depth test nor the alpha test
+    pVisTriangle->drawTexelLine = ChooseTexelLineFunc(GetTexelKernelState(
+        false,
+        true,
+        pVisTriangle->lightIntensity,
+        pVisTriangle->textureWidth,
+        pVisTriangle->textureHeight));
+
+    const uint32_t* alphaTexture = (pMaterial->isTextureOpaque) ? NULL : pVisTriangle->textureBuffer;
+    const int subdivLength = (IsRenderFlag(RENDER_FLAG_SUBDIV_SPANS)) ? GetSubdivSpanLength() : 0;
+
+    // choose the depth pass kernel
+    VisibilityPixelsFunc drawVisibilityPixels = DrawVisibilityPixels;
+#if SIMD_ENABLED
+    if (IsRenderFlag(RENDER_FLAG_SIMD))
+        drawVisibilityPixels = DrawVisibilityPixelsSimd;
+#endif
+
+    const bool isHiZ = IsRenderFlag(RENDER_FLAG_HIZ);
+    uint64_t visibleBlocks = HIZ_ALL_VISIBLE;
+
+    Interpolants row = pSetup->origin;
+    Interpolants start;
+    int xEnd = 0;
+
+    for (int y = pSetup->minY; y <= pSetup->maxY; ++y, StepInterpolants(&row, &pSetup->dy))
+    {
+        // test the blocks of each next block row against the Hi-Z
+        if (isHiZ && ((y == pSetup->minY) || ((y & HIZ_BLOCK_MASK) == 0)))
+            visibleBlocks = GetVisibleBlocks(pSetup, y >> HIZ_BLOCK_SHIFT);
+
+        // the whole block row is hidden
+        if (visibleBlocks == 0)
+            continue;
+
+        const int xStart = FindRowSpan(pSetup, &row, &start, &xEnd);
+        int x = xStart;
+        int runStart = 0;
+        int runEnd = 0;
+
+        while (FindVisibleRun(pSetup, visibleBlocks, xEnd, &x, &runStart, &runEnd))
+        {
+            drawVisibilityPixels(
+                &start,
+                &pSetup->dx,
                 xStart,
                 xEnd,
+                runStart,
+                runEnd,
                 y,
-                textureWidth,
-                textureHeight,
-                textureBuffer);      
+                id,
+                pVisTriangle->textureWidth,
+                pVisTriangle->textureHeight,
+                alphaTexture,
+                subdivLength);
+
+            if (isHiZ)
+                MarkHiZBlocksDirty(y, runStart, runEnd);
         }
     }
+
+    return true;
 }
 
+///////////////////////////////////////////////////////////
+
+void ShadeVisibilityBuffer(VisibilityTriangle* visTriangles, const Rect* pRect)
+{
+    const uint32_t* idBuffer = GetIdBuffer();
+
+    for (int y = pRect->minY; y <= pRect->maxY; ++y)
+    {
+        const uint32_t* idRow = idBuffer + GetWindowWidth() * y;
+        int x = pRect->minX;
+
+        while (x <= pRect->maxX)
+        {
+            // find a run of pixels which are covered by the same triangle
+            const uint32_t id = idRow[x];
+            int runEnd = x;
+
+            while ((runEnd < pRect->maxX) && (idRow[runEnd + 1] == id))
+                runEnd++;
+
+            if (id != ID_BUFFER_EMPTY)
+            {
+                VisibilityTriangle* pTr = visTriangles + id;
+                const TriangleSetup* pSetup = &pTr->setup;
+
+                // rows are shaded from top to bottom, so step the triangle
+                // down to this row and find the span of this row only once
+                if (pTr->spanY != y)
+                {
+                    for (; pTr->rowY < y; pTr->rowY++)
+                        StepInterpolants(&pTr->row, &pSetup->dy);
+
+                    pTr->xStart = FindRowSpan(pSetup, &pTr->row, &pTr->start, &pTr->xEnd);
+                    pTr->spanY  = y;
+                }
+
+                pTr->drawTexelLine(
+                    pTr->start,
+                    &pSetup->dx,
+                    pTr->lightIntensity,
+                    pTr->xStart,
+                    pTr->xEnd,
+                    x,
+                    runEnd,
+                    y,
+                    pTr->textureWidth,
+                    pTr->textureHeight,
+                    pTr->textureBuffer);
+            }
+
+            x = runEnd + 1;
+        }
+    }
+}
+
+// ==================================================================
+// Sorting of triangles by depth: a LSD radix sort over 64-bit items
+// where the high 32 bits are the depth key and the low 32 bits are
+// the idx of the triangle, so only 8 bytes per triangle are moved
+// instead of the whole Triangle structs; the sort is stable so
+// triangles with equal keys keep their input order
+// ==================================================================
+#define SORT_RADIX_BITS  11
+#define SORT_RADIX_SIZE  (1 << SORT_RADIX_BITS)
+#define SORT_RADIX_MASK  (SORT_RADIX_SIZE - 1)
+#define SORT_NUM_PASSES  3      // 3 passes of 11 bits cover the 32-bit key
+
+// dynamic arrs which keep their memory from frame to frame
+static uint64_t* s_SortItems = NULL;
+static uint64_t* s_SortTemp  = NULL;
+
+///////////////////////////////////////////////////////////
+
+static inline uint32_t FloatToSortKey(const float value)
+{
+    // map the float bits to an unsigned int with the same order:
+    // flip all the bits of negative values and only the sign bit of positive ones
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+}
+
+///////////////////////////////////////////////////////////
+
+void SortTriangles(
+    const float* depthKeys,
+    const int numTriangles,
+    const int order,
+    int* sortedIdxs)
+{
+    if (numTriangles <= 0)
+        return;
+
+    assert(depthKeys && sortedIdxs && "invalid input args");
+    assert((order == SORT_FRONT_TO_BACK || order == SORT_BACK_TO_FRONT) && "invalid sort order");
+
+    ArrayClear(s_SortItems);
+    ArrayClear(s_SortTemp);
+    s_SortItems = ArrayHold(s_SortItems, numTriangles, sizeof(uint64_t));
+    s_SortTemp  = ArrayHold(s_SortTemp,  numTriangles, sizeof(uint64_t));
+
+    uint64_t* src = s_SortItems;
+    uint64_t* dst = s_SortTemp;
+
+    // count the digits of all the passes during a single read of the keys
+    uint32_t counts[SORT_NUM_PASSES][SORT_RADIX_SIZE];
+    memset(counts, 0, sizeof(counts));
+
+    for (int i = 0; i < numTriangles; ++i)
+    {
+        // the sum of w (view depth) of the vertices has
+        // the same order as the average depth
+        uint32_t key = FloatToSortKey(depthKeys[i]);
+
+        if (order == SORT_BACK_TO_FRONT)
+            key = ~key;
+
+        src[i] = ((uint64_t)key << 32) | (uint32_t)i;
+
+        for (int pass = 0; pass < SORT_NUM_PASSES; ++pass)
+            counts[pass][(key >> (pass * SORT_RADIX_BITS)) & SORT_RADIX_MASK]++;
+    }
+
+    for (int pass = 0; pass < SORT_NUM_PASSES; ++pass)
+    {
+        const int shift = 32 + pass * SORT_RADIX_BITS;
+        uint32_t* offsets = counts[pass];
+
+        // all the keys have the same digit so there is nothing to reorder
+        if (offsets[(src[0] >> shift) & SORT_RADIX_MASK] == (uint32_t)numTriangles)
+            continue;
+
+        // turn the counts into the first position of each digit
+        uint32_t offset = 0;
+
+        for (int digit = 0; digit < SORT_RADIX_SIZE; ++digit)
+        {
+            const uint32_t count = offsets[digit];
+            offsets[digit] = offset;
+            offset += count;
+        }
+
+        for (int i = 0; i < numTriangles; ++i)
+        {
+            const uint64_t item = src[i];
+            dst[offsets[(item >> shift) & SORT_RADIX_MASK]++] = item;
+        }
+
+        uint64_t* temp = src;
+        src = dst;
+        dst = temp;
+    }
+
+    for (int i = 0; i < numTriangles; ++i)
+        sortedIdxs[i] = (int)(uint32_t)src[i];
+}
+
+///////////////////////////////////////////////////////////
+
+void FreeSortBuffers(void)
+{
+    if (s_SortItems)
+        ArrayFree((void**)&s_SortItems);
+
+    if (s_SortTemp)
+        ArrayFree((void**)&s_SortTemp);
+}
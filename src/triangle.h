@@ -3,15 +3,56 @@
 // Description: functional for:
 //              1. rendering of triangles filled with solid color
 //              2. rendering of triangles which are textured
+//
+//              both are rasterized with the half-space (edge function)
+//              method: all the per-pixel values are stepped by additions;
+//              vertices are snapped to the 28.4 fixed-point format and
+//              pixels are sampled at their centers with the top-left
+//              fill rule, so each covered pixel is drawn exactly once
 // ==================================================================
 
 #ifndef TRIANGLE_H
 #define TRIANGLE_H
 
 #include <stdint.h>
+#include <math.h>
 #include "vector.h"
 #include "texture.h"
+#include "display.h"
 #include "upng.h"
+#include "render_queue.h"
+
+// ==================================================================
+// Sub-pixel precision of the rasterizer (28.4 fixed-point coords)
+// ==================================================================
+#define SUBPIXEL_BITS  4
+#define SUBPIXEL_ONE   (1 << SUBPIXEL_BITS)     // one pixel
+#define SUBPIXEL_HALF  (SUBPIXEL_ONE >> 1)      // offset to the pixel center
+
+// convert a screen coordinate into the 28.4 fixed-point format
+static inline int ToSubpixel(const float v)
+{
+    return (int)lrintf(v * SUBPIXEL_ONE);
+}
+
+// the first pixel which center is >= v (v is in 28.4 format)
+static inline int SubpixelToFirstPixel(const int v)
+{
+    return (v + SUBPIXEL_HALF - 1) >> SUBPIXEL_BITS;
+}
+
+// the last pixel which center is <= v (v is in 28.4 format)
+static inline int SubpixelToLastPixel(const int v)
+{
+    return (v - SUBPIXEL_HALF) >> SUBPIXEL_BITS;
+}
+
+// the pixel which contains v (v is in 28.4 format)
+static inline int SubpixelToPixel(const int v)
+{
+    return v >> SUBPIXEL_BITS;
+}
+
 
 // ==================================================================
 // Typedefs
@@ -29,66 +70,129 @@ typedef struct
     uint32_t color;
 } Face;
 
-// stores the actual Vec2 points of the triangle in the screen
+// a triangle which is assembled from a clipped polygon
+// (the render state is kept in the render queue)
 typedef struct 
 {
     Vec4 points[3];
     Tex2 texCoords[3];
-    uint32_t color;
-    float lightIntensity;   // over the triangle
-    upng_t* pTexture;
 } Triangle;
 
+// values which are linear in the screen space and so can be 
+// interpolated over the triangle with only additions
+typedef struct
+{
+    int64_t edge[3];        // edge functions (all are >= 0 inside the triangle)
+    float   recipW;         // 1/w
+    float   uOverW;         // u/w
+    float   vOverW;         // v/w
+} Interpolants;
+
+// precomputed data to rasterize a triangle within its bounding box
+typedef struct
+{
+    Interpolants origin;    // values at the center of the top-left pixel of the bounding box
+    Interpolants dx;        // increments for one pixel to the right
+    Interpolants dy;        // increments for one row down
+    int minX, minY;         // bounding box clamped to the clip rectangle
+    int maxX, maxY;
+    float maxRecipW;        // max 1/w of the vertices (it gives the min depth of the triangle)
+} TriangleSetup;
+
 
 // ==================================================================
 // Functions declarations
 // ==================================================================
 void DrawFilledTriangle(
-    int x0, int y0, float w0,
-    int x1, int y1, float w1,
-    int x2, int y2, float w2,
-    const float lightIntensity,
-    const uint32_t color);
+    const RenderQueue* pQueue,
+    const int triangleIdx,                  // the idx of the triangle in the render queue
+    const Rect* pClipRect);                 // only pixels inside this rect are drawn
 
 Vec3 GetTriangleNormal(const Vec4 v0, const Vec4 v1, const Vec4 v2);
 
-// sort triangles by average depth
+// the order of drawing triangles
+enum SortOrder
+{
+    SORT_FRONT_TO_BACK,     // nearer pixels are drawn first so the z-test rejects more of the farther ones
+    SORT_BACK_TO_FRONT,     // for the painter's algorithm (drawing without the z-buffer)
+};
+
+// sort triangles by average depth: fill sortedIdxs with
+// idxs of the triangles in the given order
 void SortTriangles(
-    Triangle* arr, 
-    const int numTriangles, 
-    const int low, 
-    const int high);
+    const float* depthKeys,             // a depth key per triangle (the depth stream of the render queue)
+    const int numTriangles,
+    const int order,
+    int* sortedIdxs);
+
+void FreeSortBuffers(void);
 
 
 void DrawTexelLine(
-    const Vec2Int a,            // point A
-    const Vec2Int b,            // point B
-    const Vec2Int c,            // point C
-    const Vec2Int ac,
-    const Tex2 texA,
-    const Tex2 texB,
-    const Tex2 texC,
-    const float invArea,
-    const float w0,             // w-component of point A
-    const float w1,             // w-component of point B
-    const float w2,             // w-component of point C
+    Interpolants value,         // interpolated values at the pixel (xStart, y)
+    const Interpolants* pStep,  // their increments for one pixel to the right
+    const float lightIntensity,
+    const int xStart,           // the span [xStart, xEnd] of the row
+    const int xEnd,
+    const int xFirst,           // the pixels [xFirst, xLast] of the span to draw
+    const int xLast,
+    const int y,
+    const int textureWidth,
+    const int textureHeight,
+    const uint32_t* textureBuffer);
+
+
+// a kernel which draws a textured line (DrawTexelLine or one of its specialized versions)
+typedef void (*TexelLineFunc)(
+    Interpolants value,
+    const Interpolants* pStep,
     const float lightIntensity,
     const int xStart,
     const int xEnd,
+    const int xFirst,
+    const int xLast,
     const int y,
     const int textureWidth,
     const int textureHeight,
     const uint32_t* textureBuffer);
 
 
+// a triangle which is rendered in the visibility buffer mode: its setup
+// is kept after the depth pass, and the shading pass walks its rows down
+typedef struct
+{
+    TriangleSetup setup;
+    Interpolants row;       // values at the left side of the bounding box of the row rowY
+    Interpolants start;     // values at the first pixel of the span of the row spanY
+    int rowY;
+    int spanY;              // -1 if the span isn't found yet
+    int xStart, xEnd;       // the span of the row spanY
+    float lightIntensity;
+    int textureWidth;
+    int textureHeight;
+    const uint32_t* textureBuffer;
+    TexelLineFunc drawTexelLine;    // the kernel chosen for the state of the triangle
+} VisibilityTriangle;
+
+// the visibility buffer mode (deferred texturing):
+// 1. the depth pass writes only the depth and the id of each triangle;
+// 2. the shading pass textures each pixel of the rect exactly once
+//    using the triangle which id is in the pixel
+bool DrawTriangleVisibility(
+    const RenderQueue* pQueue,
+    const int triangleIdx,              // the idx of the triangle in the render queue
+    const uint32_t id,                  // the idx of the triangle in the arr of visibility triangles
+    const Rect* pClipRect,
+    VisibilityTriangle* pVisTriangle);  // out: the triangle to shade (if true is returned)
+
+void ShadeVisibilityBuffer(
+    VisibilityTriangle* visTriangles,
+    const Rect* pRect);
+
+
 void DrawTexturedTriangle(
-    int x0, int y0, float z0, float w0,     // vec4: xyzw of a projected triangle
-    int x1, int y1, float z1, float w1,
-    int x2, int y2, float z2, float w2,
-    float u0, float v0,                     // uv texture coords of the 1st triangle vertex    
-    float u1, float v1,                     // ... of the 2nd triangle vertex
-    float u2, float v2,                     // ... and of the 3rd triangle vertex
-    float lightIntensity,                                            
-    const upng_t* texture);
+    const RenderQueue* pQueue,
+    const int triangleIdx,                  // the idx of the triangle in the render queue
+    const Rect* pClipRect);                 // only pixels inside this rect are drawn
 
 #endif
@@ -24,6 +24,16 @@ typedef struct
     float x, y, z, w;
 } Vec4;
 
+// structure-of-arrays (SoA) streams of points, so a few points
+// can be loaded into SIMD registers component by component
+typedef struct
+{
+    float* x;
+    float* y;
+    float* z;
+    float* w;
+} PointStreams;
+
 
 // ==================================================================
 // Vector 2D functions